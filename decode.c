@@ -1,435 +1,1287 @@
 
+#include <math.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <png.h>
+#include "qoi.h"
+#include "qoiDecoder.h"
+#include "ioRing.h"
+#include "watch.h"
 
+// Returns the length of the file, which for qoiz is not the stream's
+long readQoifFile(const char* filename, QoifStream *qoif, PixelBuffer *image) {
+    FILE* fp = fopen(filename, "rb");
+    if (!fp) {
+        err = OpenFileError;
+        return 0;
+    }
+
+    // Read the qoif file
+    fseek(fp, 0, SEEK_END);
+    long length = ftell(fp);
+    fseek(fp, 0, SEEK_SET);  /* same as rewind(f); */
+
+    unsigned char* data = malloc(length);
+    if (!data) {
+        fclose(fp);
+        err = MemAllocError;
+        return 0;
+    }
+    fread(data, length, 1, fp);
+    fclose(fp);
+
+    openQoifBuffer(data, length, qoif, image);
+    return length;
+}
 
-typedef struct {
-    unsigned char r, g, b, a;
-} PixelRGBA;
 
 typedef struct {
     unsigned char* data;
-    int width;
-    int height;
-    long bytesProcessed;
-    long totalLengthInBytes;
-} QoifImage;
+    long length;
+    long capacity;
+} PngSink;
+
+void writePngSink(png_structp png, png_bytep in, png_size_t count) {
+    PngSink* sink = png_get_io_ptr(png);
+    if (sink->length + (long) count > sink->capacity) {
+        long capacity = sink->capacity ? sink->capacity*2 : 1<<16;
+        while (capacity < sink->length + (long) count) capacity *= 2;
+        unsigned char* data = realloc(sink->data, capacity);
+        if (!data) png_error(png, "Out of memory");
+        sink->data = data;
+        sink->capacity = capacity;
+    }
+    memcpy(sink->data + sink->length, in, count);
+    sink->length += count;
+}
 
-typedef struct {
-    PixelRGBA* data;  // Pointer to RGB or RGBA data
-    long pixelsAdded;
-} RawImage;
+void flushPngSink(png_structp png) {
+}
 
-typedef struct {
-    unsigned char r, g, b;
-} ChunkRGB;
+// Writes to fp, or appends to sink when fp is NULL
+void writePng(FILE* fp, PngSink *sink, char* rgbaPixelsStart, int width, int height) {
 
-typedef struct {
-    unsigned char r, g, b, a;
-} ChunkRGBA;
+    // Initialize the PNG structures
+    png_structp png = png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+    if (!png) {
+        err = PngError;
+        return;
+    }
 
-typedef struct {
-    unsigned char index;
-} ChunkINDEX;
+    png_infop info = png_create_info_struct(png);
+    if (!info) {
+        err = PngError;
+        png_destroy_write_struct(&png, NULL);
+        return;
+    }
 
-typedef struct {
-    unsigned char dr, dg, db;
-} ChunkDIFF;
+    if (setjmp(png_jmpbuf(png))) {
+        err = PngError;
+        png_destroy_write_struct(&png, &info);
+        return;
+    }
 
-typedef struct {
-    unsigned char dg, drdg, dbdg;
-} ChunkLUMA;
+    // Set the output file
+    if (fp) png_init_io(png, fp);
+    else png_set_write_fn(png, sink, writePngSink, flushPngSink);
 
-typedef struct {
-    unsigned char run;
-} ChunkRUN;
+    // Write the PNG header info (color type: PNG_COLOR_TYPE_RGBA)
+    png_set_IHDR(png, info, width, height, 8, PNG_COLOR_TYPE_RGBA,
+                 PNG_INTERLACE_NONE, PNG_COMPRESSION_TYPE_DEFAULT, PNG_FILTER_TYPE_DEFAULT);
 
-typedef struct {
+    png_write_info(png, info);
+
+    // Write the pixel data
+    for (int y = 0; y < height; y++) {
+        png_write_row(png, (png_bytep)(rgbaPixelsStart + (long) y * width * 4)); // RGBA is 4 bytes per pixel
+    }
+
+    // End the writing process
+    png_write_end(png, NULL);
+
+    // Clean up
+    png_destroy_write_struct(&png, &info);
+    err = NoError;
+}
+
+void saveAsPngFile(char* rgbaPixelsStart, int width, int height, char* filename) {
+    FILE *fp = fopen(filename, "wb");
+    if (!fp) {
+        err = OpenFileError;
+        return;
+    }
+    writePng(fp, NULL, rgbaPixelsStart, width, height);
+    if (fclose(fp) != 0 && err == NoError) err = WriteFileError;
+}
 
-} ChunkNONE;
 
 typedef struct {
-    int type; // 0=RGB, 1=RGBA, 2=INDEX, 3=DIFF, 4=LUMA, 5=RUN, 6=NONE
-    union {
-        ChunkRGB RGB;
-        ChunkRGBA RGBA;
-        ChunkINDEX INDEX;
-        ChunkDIFF DIFF;
-        ChunkLUMA LUMA;
-        ChunkRUN RUN;
-        ChunkNONE NONE;
-    };
-} QoifChunk;
-
-
-enum Error { NoError, OpenFileError, ReadFileError, MemAllocError, PngError, WriteFileError} err;
-
-char* errorMessages[] = {
-    "No errors",
-    "Can't open file",
-    "Can't read file",
-    "Can't allocate enough memory",
-    "Error related to libpng",
-    "Can't write file"
-};
-
-void writeChunkRGB(RawImage *raw, QoifChunk chunk) {
-    PixelRGBA *cur = raw->data + raw->pixelsAdded;
-    PixelRGBA* prev;
-    if (raw->pixelsAdded==0) {
-        prev = &(PixelRGBA){0,0,0,255};
+    FileList* files;
+    long nextFile;  // shared work counter
+    long invalid;
+} ValidateJob;
+
+int validateFile(const char* filename) {
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0) {
+        printf("INVALID %s: %s\n", filename, errorMessages[OpenFileError]);
+        return 1;
     }
-    else {
-        prev = cur-1;
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        printf("INVALID %s: %s\n", filename, errorMessages[ReadFileError]);
+        close(fd);
+        return 1;
     }
-    cur->r = chunk.RGB.r;
-    cur->g = chunk.RGB.g;
-    cur->b = chunk.RGB.b;
-    cur->a = prev->a;
 
-    raw->pixelsAdded++;
+    unsigned char* data = NULL;
+    if (st.st_size > 0) {
+        data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (data == MAP_FAILED) {
+            printf("INVALID %s: %s\n", filename, errorMessages[ReadFileError]);
+            close(fd);
+            return 1;
+        }
+    }
+    close(fd);
+
+    long offset, pixels;
+    enum Error result = validateQoif(data, st.st_size, &offset, &pixels);
+    if (result != NoError) {
+        printf("INVALID %s: %s at offset %ld (%ld pixels covered)\n", filename, errorMessages[result], offset, pixels);
+    }
+    if (data) munmap(data, st.st_size);
+    return result != NoError;
 }
-void writeChunkRGBA(RawImage *raw, QoifChunk chunk) {
-    PixelRGBA *cur = raw->data + raw->pixelsAdded;
-    cur->r = chunk.RGBA.r;
-    cur->g = chunk.RGBA.g;
-    cur->b = chunk.RGBA.b;
-    cur->a = chunk.RGBA.a;
-    raw->pixelsAdded++;
+
+void* validateWorker(void* arg) {
+    ValidateJob* job = arg;
+    while (1) {
+        long i = __atomic_fetch_add(&job->nextFile, 1, __ATOMIC_RELAXED);
+        if (i >= job->files->count) break;
+        if (validateFile(job->files->names[i])) {
+            __atomic_fetch_add(&job->invalid, 1, __ATOMIC_RELAXED);
+        }
+    }
+    return NULL;
 }
 
-void writeChunkRUN(RawImage *raw, QoifChunk chunk) {
-    PixelRGBA *cur = raw->data + raw->pixelsAdded;
-    PixelRGBA* prev;
-    if (raw->pixelsAdded==0) {
-        prev = &(PixelRGBA){0,0,0,255};
+// decode --validate: parses every file without writing anything
+int validateFiles(FileList *files, int threads) {
+    if (threads < 1) threads = 1;
+    if (threads > files->count) threads = files->count;
+
+    ValidateJob job = { .files = files };
+    pthread_t workers[threads];
+    for (int i = 0; i < threads; i++) {
+        pthread_create(&workers[i], NULL, validateWorker, &job);
     }
-    else {
-        prev = cur-1;
+    for (int i = 0; i < threads; i++) {
+        pthread_join(workers[i], NULL);
     }
-    for (int i = 0; i<chunk.RUN.run+1; i++) {
-        cur->r = prev->r;
-        cur->g = prev->g;
-        cur->b = prev->b;
-        cur->a = prev->a;
-        raw->pixelsAdded++;
-        cur++;
+
+    printf("%ld files, %ld invalid\n", files->count, job.invalid);
+    return job.invalid ? 1 : 0;
+}
+
+
+// "BGRA" and the like: any order of the letters r, g, b, a
+int parseSwizzle(const char* text, int order[4]) {
+    const char* letters = "rgba";
+    if (strlen(text) != 4) return 0;
+    int seen = 0;
+    for (int i = 0; i < 4; i++) {
+        const char* found = strchr(letters, text[i] | 0x20);
+        if (!found || !text[i]) return 0;
+        order[i] = found - letters;
+        seen |= 1 << order[i];
     }
+    return seen == 15;
 }
 
-void writeChunkDIFF(RawImage *raw, QoifChunk chunk) {
-    PixelRGBA *cur = raw->data + raw->pixelsAdded;
-    PixelRGBA* prev;
-    if (raw->pixelsAdded==0) {
-        prev = &(PixelRGBA){0,0,0,255};
+// "a" sets all four channels, "a,b,c[,d]" one each
+void parseChannelValues(const char* text, float values[4]) {
+    int n = sscanf(text, "%f,%f,%f,%f", &values[0], &values[1], &values[2], &values[3]);
+    if (n == 1) values[1] = values[2] = values[3] = values[0];
+}
+
+void saveBufferToFile(unsigned char* data, long length, char* filename) {
+    FILE* file = fopen(filename, "wb");
+    if (!file) {
+        err = OpenFileError;
+        return;
     }
-    else {
-        prev = cur-1;
+    size_t written = fwrite(data, 1, length, file);
+    if (fclose(file) != 0 || written != (size_t) length) {
+        err = WriteFileError;
+        return;
     }
-    cur->r = prev->r + chunk.DIFF.dr -2;
-    cur->g = prev->g + chunk.DIFF.dg -2;
-    cur->b = prev->b + chunk.DIFF.db -2;
-    cur->a = prev->a;
-    raw->pixelsAdded++;
+    err = NoError;
 }
 
-void writeChunkLUMA(RawImage *raw, QoifChunk chunk) {
-    PixelRGBA *cur = raw->data + raw->pixelsAdded;
-    PixelRGBA* prev;
-    if (raw->pixelsAdded==0) {
-        prev = &(PixelRGBA){0,0,0,255};
+
+int decodeWithLayout(const char* input, const char* output, Layout *layout, int asPng, int statsFormat, int analyze) {
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    QoifStream qoif;
+    long fileBytes = readQoifFile(input, &qoif, NULL);
+    if (err != NoError) {
+        printf("%s\n", errorMessages[err]);
+        return 1;
     }
-    else {
-        prev = cur-1;
+    if (layout->channels == 0) layout->channels = qoif.data[12] == 3 ? 3 : 4;
+    if (layout->pitch < (long) qoif.width * 4) layout->pitch = (long) qoif.width * 4;
+
+    long size = layoutSize(layout, qoif.width, qoif.height);
+    unsigned char* out = calloc(size, 1);
+    if (!out) {
+        printf("%s\n", errorMessages[MemAllocError]);
+        return 1;
+    }
+    if (stats) {
+        stats->seconds[0] = secondsSince(start);
+        clock_gettime(CLOCK_MONOTONIC, &start);
+    }
+    Analytics gathered;
+    if (analyze) {
+        startAnalytics(&gathered, qoif.width, qoif.height);
+        analytics = &gathered;
     }
-    cur->g = prev->g + chunk.LUMA.dg - 32;
-    cur->r = prev->r + chunk.LUMA.drdg + chunk.LUMA.dg -32 -8;
-    cur->b = prev->b + chunk.LUMA.dbdg + chunk.LUMA.dg -32 -8;
-    cur->a = prev->a;
-    raw->pixelsAdded++;
+    // chunks that run out before the last pixel leave the rest of out zero
+    if (decodeToLayout(&qoif, layout, out) < (long) qoif.width * qoif.height && err == NoError) err = TruncatedError;
+    if (stats) {
+        stats->seconds[1] = secondsSince(start);
+        clock_gettime(CLOCK_MONOTONIC, &start);
+    }
+    if (err == NoError && asPng) saveAsPngFile((char*) out, qoif.width, qoif.height, (char*) output);
+    else if (err == NoError) saveBufferToFile(out, size, (char*) output);
+    if (analytics && err == NoError) saveAnalytics(analytics, output);
+    free(out);
+    if (err != NoError) {
+        printf("%s\n", errorMessages[err]);
+        return 1;
+    }
+    if (stats) {
+        stats->seconds[2] = secondsSince(start);
+        printStats(stats, statsFormat==2, (long) qoif.width * qoif.height, fileBytes, "decode");
+    }
+    return 0;
 }
 
-void writeChunkINDEX(RawImage *raw, QoifChunk chunk, PixelRGBA* palette) {
-    PixelRGBA *cur = raw->data + raw->pixelsAdded;
-    cur->r = palette[chunk.INDEX.index].r;
-    cur->g = palette[chunk.INDEX.index].g;
-    cur->b = palette[chunk.INDEX.index].b;
-    cur->a = palette[chunk.INDEX.index].a;
-    raw->pixelsAdded++;
+// Sprite pack ("qpak") written by encode --pack, see there for the layout
+
+typedef struct {
+    unsigned char* data; // whole pack, mmapped
+    long length;
+    uint32_t count;
+    uint32_t slots;
+    const char* outdir;
+    long nextSlot;       // shared work counter for bulk unpacking
+    long failed;
+} Pack;
+
+
+uint64_t getBE64(const unsigned char* src) {
+    return ((uint64_t) getBE32(src) << 32) | getBE32(src + 4);
 }
 
+void openPack(const char* filename, Pack *pack) {
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0) {
+        err = OpenFileError;
+        return;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size < 12) {
+        close(fd);
+        err = HeaderError;
+        return;
+    }
+    pack->length = st.st_size;
+    pack->data = mmap(NULL, pack->length, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (pack->data == MAP_FAILED) {
+        err = ReadFileError;
+        return;
+    }
+
+    pack->count = getBE32(pack->data + 4);
+    pack->slots = getBE32(pack->data + 8);
+    if (memcmp(pack->data, "qpak", 4) != 0 || pack->slots == 0 || (pack->slots & (pack->slots-1)) != 0 ||
+        12 + 32L*pack->slots > pack->length) {
+        err = HeaderError;
+        return;
+    }
+    err = NoError;
+}
 
+// Slot of the named sprite, -1 if the pack doesn't have it
+long findInPack(Pack *pack, const char* name) {
+    uint64_t hash = hashName(name);
+    uint32_t slot = hash & (pack->slots-1);
+    for (uint32_t probes = 0; probes < pack->slots; probes++) {
+        unsigned char* entry = pack->data + 12 + 32L*slot;
+        uint64_t used = getBE64(entry);
+        if (used == 0) return -1;
+        uint32_t nameOffset = getBE32(entry+28);
+        if (used == hash && nameOffset < pack->length &&
+            strncmp((char*) pack->data + nameOffset, name, pack->length - nameOffset) == 0) {
+            return slot;
+        }
+        slot = (slot+1) & (pack->slots-1);
+    }
+    return -1;
+}
 
+// Decodes one sprite straight out of the mapping into outdir/name.png
+void unpackSprite(Pack *pack, long slot) {
+    unsigned char* entry = pack->data + 12 + 32L*slot;
+    uint64_t offset = getBE64(entry+8);
+    uint32_t length = getBE32(entry+16);
+    uint32_t nameOffset = getBE32(entry+28);
+    if (offset > (uint64_t) pack->length || length > pack->length - offset || nameOffset >= pack->length ||
+        memchr(pack->data + nameOffset, 0, pack->length - nameOffset) == NULL ||
+        !isSafeName((char*) pack->data + nameOffset)) {
+        err = HeaderError;
+        return;
+    }
 
-void addToPalette( PixelRGBA pixel, PixelRGBA* palette ) {
-    // Note: assumes minimum 64 length. UB if not.
-    int index = ( pixel.r*3 + pixel.g*5 + pixel.b*7 + pixel.a*11 ) % 64;
-    palette[ index ] = pixel;
+    // the sprite has to be what the index says, not only a valid stream
+    QoifStream qoif;
+    PixelBuffer raw;
+    openQoifBuffer(pack->data + offset, length, &qoif, &raw);
+    if (err == NoError && ((uint32_t) qoif.width != getBE32(entry+20) || (uint32_t) qoif.height != getBE32(entry+24))) {
+        free(raw.data);
+        err = HeaderError;
+    }
+    if (err != NoError) return;
+    decodeBody(&qoif, &raw);
+    if (err != NoError) {
+        free(raw.data);
+        return;
+    }
+
+    char filename[4096];
+    snprintf(filename, sizeof(filename), "%s/%s.png", pack->outdir, (char*) pack->data + nameOffset);
+    saveAsPngFile((char*) raw.data, qoif.width, qoif.height, filename);
+    free(raw.data);
 }
 
-int getFromPalette( PixelRGBA pixel, PixelRGBA* palette ) {
-    // Note: assumes minimum 64 length. UB if not.
-    int index = ( pixel.r*3 + pixel.g*5 + pixel.b*7 + pixel.a*11 ) % 64;
-    return index;
+void* unpackWorker(void* arg) {
+    Pack* pack = arg;
+    while (1) {
+        long slot = __atomic_fetch_add(&pack->nextSlot, 1, __ATOMIC_RELAXED);
+        if (slot >= pack->slots) break;
+        if (getBE64(pack->data + 12 + 32L*slot) == 0) continue;
+        unpackSprite(pack, slot);
+        if (err != NoError) {
+            printf("slot %ld: %s\n", slot, errorMessages[err]);
+            __atomic_fetch_add(&pack->failed, 1, __ATOMIC_RELAXED);
+        }
+    }
+    return NULL;
 }
 
+// decode --pack: the named sprites, or all of them when no names are given
+int unpackFiles(const char* filename, const char* outdir, char** names, int nameCount, int threads) {
+    Pack pack = { .outdir = outdir };
+    openPack(filename, &pack);
+    if (err != NoError) {
+        printf("%s\n", errorMessages[err]);
+        return 1;
+    }
 
-QoifChunk fetchNextChunk( QoifImage *qoif, RawImage raw, PixelRGBA palette[64]) {
+    if (nameCount > 0) {
+        for (int i = 0; i<nameCount; i++) {
+            long slot = findInPack(&pack, names[i]);
+            if (slot < 0) {
+                printf("%s: not in pack\n", names[i]);
+                pack.failed++;
+                continue;
+            }
+            unpackSprite(&pack, slot);
+            if (err != NoError) {
+                printf("%s: %s\n", names[i], errorMessages[err]);
+                pack.failed++;
+            }
+        }
+        return pack.failed ? 1 : 0;
+    }
 
-    // assuming pixelsProcessed != totalLengthInPixels
-    PixelRGBA* cur = ((PixelRGBA*) raw.data) + raw.pixelsAdded;
-    PixelRGBA* prev;
-    if (raw.pixelsAdded==0) {
-        prev = &(PixelRGBA){0,0,0,255};
+    if (threads < 1) threads = 1;
+    pthread_t workers[threads];
+    for (int i = 0; i < threads; i++) {
+        pthread_create(&workers[i], NULL, unpackWorker, &pack);
     }
-    else {
-        prev = cur-1;
+    for (int i = 0; i < threads; i++) {
+        pthread_join(workers[i], NULL);
     }
+    return pack.failed ? 1 : 0;
+}
+
 
-    unsigned char* chunk = (qoif->data + qoif->bytesProcessed);
+// Frame sequence ("qseq") written by encode --sequence, see there for the layout.
+// Frames are decoded in place over the previous one, so rows and pixels that didn't
+// change cost nothing.
 
-    if ( *chunk==0xfe ) {
-        // RGB
-        if (qoif->bytesProcessed+3 >= qoif->totalLengthInBytes) {
-            // not enough bytes. finalize
-            return (QoifChunk) {
-                .type = 6,
-            };
+int readVarint(QoifStream *qoif, unsigned long *value) {
+    *value = 0;
+    for (int shift = 0; shift < 64; shift += 7) {
+        if (qoif->bytesProcessed >= qoif->totalLengthInBytes) return 0;
+        unsigned char byte = qoif->data[qoif->bytesProcessed++];
+        *value |= (unsigned long) (byte & 0x7f) << shift;
+        if (!(byte & 0x80)) return 1;
+    }
+    return 0;
+}
+
+// The pixel a non-RUN chunk stands for, given the pixel it was predicted from
+PixelRGBA predictPixel(FetchedChunk chunk, PixelRGBA pred, PixelRGBA palette[64]) {
+    PixelRGBA p = pred;
+    if (chunk.type == 0) {
+        p.r = chunk.RGB.r;
+        p.g = chunk.RGB.g;
+        p.b = chunk.RGB.b;
+    }
+    else if (chunk.type == 1) {
+        p = (PixelRGBA) { chunk.RGBA.r, chunk.RGBA.g, chunk.RGBA.b, chunk.RGBA.a };
+    }
+    else if (chunk.type == 2) {
+        p = palette[chunk.INDEX.index];
+    }
+    else if (chunk.type == 3) {
+        p.r += chunk.DIFF.dr - 2;
+        p.g += chunk.DIFF.dg - 2;
+        p.b += chunk.DIFF.db - 2;
+    }
+    else if (chunk.type == 4) {
+        p.g += chunk.LUMA.dg - 32;
+        p.r += chunk.LUMA.drdg + chunk.LUMA.dg - 32 - 8;
+        p.b += chunk.LUMA.dbdg + chunk.LUMA.dg - 32 - 8;
+    }
+    return p;
+}
+
+void readSpan(QoifStream *qoif, PixelRGBA* row, long n, int temporal, PixelRGBA left, PixelRGBA palette[64]) {
+    PixelBuffer unused = {0};
+    long i = 0;
+    while (i < n) {
+        if (qoif->bytesProcessed >= qoif->totalLengthInBytes) {
+            err = TruncatedError;
+            return;
         }
-        else {
-            qoif->bytesProcessed += 4;
-            return (QoifChunk) {
-                .type = 0,
-                .RGB = (ChunkRGB) {
-                    .r= *(chunk+1),
-                    .g= *(chunk+2),
-                    .b= *(chunk+3),
-                }
-            };
+        FetchedChunk chunk = fetchNextChunk(qoif, unused, palette);
+        if (chunk.type == 6) {
+            err = TruncatedError;
+            return;
         }
+        PixelRGBA pred = temporal ? row[i] : (i ? row[i-1] : left);
+        if (chunk.type == 5) {
+            long run = chunk.RUN.run + 1;
+            if (i + run > n) {
+                err = PixelCountError;
+                return;
+            }
+            if (!temporal) {
+                for (long j = 0; j < run; j++) row[i+j] = pred;
+            }
+            i += run;
+            continue;
+        }
+        row[i] = predictPixel(chunk, pred, palette);
+        addToPalette(row[i], palette);
+        i++;
     }
-    else if ( *chunk==0xff ) {
-        // RGBA
-        if (qoif->bytesProcessed+4 >= qoif->totalLengthInBytes) {
-            // not enough bytes. finalize
-            return (QoifChunk) {
-                .type = 6,
-            };
+}
+
+void readFrame(QoifStream *qoif, PixelRGBA* frame) {
+    PixelRGBA palette[64] = {0};
+    long y = 0;
+    err = NoError;
+    while (qoif->bytesProcessed < qoif->totalLengthInBytes && err == NoError) {
+        unsigned char tag = qoif->data[qoif->bytesProcessed++];
+        unsigned long x, n;
+        if (tag == 0) {
+            if (!readVarint(qoif, &n)) {
+                err = TruncatedError;
+                return;
+            }
+            y += n;
+            if (y > qoif->height) err = PixelCountError;
+            continue;
         }
-        else {
-            qoif->bytesProcessed += 5;
-            return (QoifChunk) {
-                .type = 1,
-                .RGBA = (ChunkRGBA) {
-                    .r= *(chunk+1),
-                    .g= *(chunk+2),
-                    .b= *(chunk+3),
-                    .a= *(chunk+4),
-                }
-            };
+        if (!readVarint(qoif, &x) || !readVarint(qoif, &n)) {
+            err = TruncatedError;
+            return;
+        }
+        if (tag > 2 || y >= qoif->height || x > (unsigned long) qoif->width || n > qoif->width - x) {
+            err = HeaderError;
+            return;
         }
+        PixelRGBA* row = frame + y*qoif->width;
+        PixelRGBA left = x ? row[x-1] : (PixelRGBA){0,0,0,255};
+        readSpan(qoif, row + x, n, tag == 1, left, palette);
+        y++;
     }
-    else if ( *chunk>>6 == 1 ) {
-        // DIFF
-        unsigned char dr = (*chunk >> 4) & 3;
-        unsigned char dg = (*chunk >> 2) & 3;
-        unsigned char db = (*chunk) & 3;
-        qoif->bytesProcessed += 1;
-        return (QoifChunk) {
-            .type = 3,
-            .DIFF = (ChunkDIFF) {
-                .dr = dr,
-                .dg = dg,
-                .db = db
-            }
-        };
-    }
-    else if ( *chunk>>6 == 2 ) {
-        // LUMA
-        if (qoif->bytesProcessed+1 >= qoif->totalLengthInBytes) {
-            // not enough bytes. finalize
-            return (QoifChunk) {
-                .type = 6,
-            };
+    if (err == NoError && y != qoif->height) err = PixelCountError;
+}
+
+// decode --sequence: writes one PNG per frame, returns the process exit code
+int decodeSequence(const char* input, const char* prefix) {
+    FILE* fp = fopen(input, "rb");
+    if (!fp) {
+        printf("%s\n", errorMessages[OpenFileError]);
+        return 1;
+    }
+    unsigned char header[16];
+    if (fread(header, 1, 16, fp) != 16 || memcmp(header, "qseq", 4) != 0) {
+        printf("%s\n", errorMessages[HeaderError]);
+        fclose(fp);
+        return 1;
+    }
+    QoifStream qoif = { .width = getBE32(header+4), .height = getBE32(header+8) };
+    uint32_t count = getBE32(header+12);
+
+    PixelRGBA* frame = calloc((long) qoif.width * qoif.height, sizeof(PixelRGBA));
+    long capacity = 0;
+    if (!frame) {
+        printf("%s\n", errorMessages[MemAllocError]);
+        fclose(fp);
+        return 1;
+    }
+
+    char filename[4096];
+    for (uint32_t i = 0; i < count; i++) {
+        unsigned char lengthBytes[4];
+        if (fread(lengthBytes, 1, 4, fp) != 4) {
+            printf("frame %u: %s\n", i, errorMessages[TruncatedError]);
+            fclose(fp);
+            return 1;
         }
-        unsigned char dg = (*chunk) & 0x3f;
-        unsigned char drdg = (*(chunk+1) >> 4) & 0xf;
-        unsigned char dbdg = (*(chunk+1)) & 0xf;
-        qoif->bytesProcessed += 2;
-        return (QoifChunk) {
-            .type = 4,
-            .LUMA = (ChunkLUMA) {
-                .dg = dg,
-                .drdg = drdg,
-                .dbdg = dbdg
-            }
-        };
-    }
-    else if ( *chunk>>6 == 3 ) {
-        // RUN
-        unsigned char run = (*chunk) & 0x3f;
-        qoif->bytesProcessed += 1;
-        return (QoifChunk) {
-            .type = 5,
-            .RUN = (ChunkRUN) {
-                .run = run,
-            }
-        };
-    }
-    else if ( *chunk>>6 == 0 ) {
-        // INDEX
-        unsigned char index = (*chunk) & 0x3f;
-        qoif->bytesProcessed += 1;
-        return (QoifChunk) {
-            .type = 2,
-            .INDEX = (ChunkINDEX) {
-                .index = index,
+        long length = getBE32(lengthBytes);
+        if (length > capacity) {
+            free(qoif.data);
+            capacity = length;
+            qoif.data = malloc(capacity);
+            if (!qoif.data) {
+                printf("%s\n", errorMessages[MemAllocError]);
+                fclose(fp);
+                return 1;
             }
-        };
-    } 
+        }
+        if (fread(qoif.data, 1, length, fp) != (size_t) length) {
+            printf("frame %u: %s\n", i, errorMessages[TruncatedError]);
+            fclose(fp);
+            return 1;
+        }
+        qoif.bytesProcessed = 0;
+        qoif.totalLengthInBytes = length;
+        readFrame(&qoif, frame);
+        if (err != NoError) {
+            printf("frame %u: %s at offset %ld\n", i, errorMessages[err], qoif.bytesProcessed);
+            fclose(fp);
+            return 1;
+        }
 
-    return (QoifChunk) {
-        .type = 6
-    };
+        snprintf(filename, sizeof(filename), "%s%05u.png", prefix, i);
+        saveAsPngFile((char*) frame, qoif.width, qoif.height, filename);
+        if (err != NoError) {
+            printf("%s: %s\n", filename, errorMessages[err]);
+            fclose(fp);
+            return 1;
+        }
+    }
 
+    fclose(fp);
+    free(qoif.data);
+    free(frame);
+    return 0;
 }
 
 
+// Bulk conversion (decode --bulk), the same engine as encode --bulk, see ioRing.c
 
-void readQoifFile(const char* filename, QoifImage *qoif, RawImage *image) {
-    FILE* fp = fopen(filename, "rb");
-    if (!fp) {
-        err = OpenFileError;
+void convertBuffer(unsigned char* in, long length, unsigned char** out, long* outLength) {
+    QoifStream qoif;
+    PixelBuffer raw;
+    openQoifBuffer(in, length, &qoif, &raw);
+    if (err != NoError) return;
+    decodeBody(&qoif, &raw);
+    if (err != NoError) {
+        free(raw.data);
         return;
     }
+    PngSink sink = {0};
+    writePng(NULL, &sink, (char*) raw.data, qoif.width, qoif.height);
+    free(raw.data);
+    if (err != NoError) {
+        free(sink.data);
+        return;
+    }
+    *out = sink.data;
+    *outLength = sink.length;
+}
 
-    // Read the qoif file
-    fseek(fp, 0, SEEK_END);
-    qoif->totalLengthInBytes = ftell(fp);
-    qoif->bytesProcessed = 14; // skip the header
-    fseek(fp, 0, SEEK_SET);  /* same as rewind(f); */
-
-    qoif->data = malloc(qoif->totalLengthInBytes);
-    fread(qoif->data, qoif->totalLengthInBytes, 1, fp);
-    fclose(fp);
 
-    // Allocate for raw image
-    qoif->width = qoif->data[4]*(1<<24) + qoif->data[5]*(1<<16) + qoif->data[6]*(1<<8) + qoif->data[7];
-    qoif->height = qoif->data[8]*(1<<24) + qoif->data[9]*(1<<16) + qoif->data[10]*(1<<8) + qoif->data[11];
+// Watch mode (decode --watch), see watch.c. The pixels and the PNG go to the worker's warm
+// buffers; libpng can't reset a png_struct for the next image, so those are made per file.
 
-    image->data = (PixelRGBA*)malloc( qoif->width * qoif->height * 4 );
-    if (!image->data) {
+void convertSpooledQoi(WarmBuffers *warm, long length) {
+    QoifStream qoif;
+    openQoifBuffer(warm->in, length, &qoif, NULL);
+    if (err != NoError) return;
+    // a corrupt RUN may overshoot the image by up to 62 pixels
+    if (!reserveWarm(&warm->pixels, &warm->pixelCapacity, ((long) qoif.width * qoif.height + 62) * 4)) {
         err = MemAllocError;
         return;
     }
+    PixelBuffer raw = { (PixelRGBA*) warm->pixels, 0 };
+    decodeBody(&qoif, &raw);
+    if (err != NoError) return;
+    PngSink sink = { warm->out, 0, warm->outCapacity };
+    writePng(NULL, &sink, (char*) raw.data, qoif.width, qoif.height);
+    warm->out = sink.data;
+    warm->outCapacity = sink.capacity;
+    warm->outLength = sink.length;
+}
+
+
+// Reads the file in pieces, as a slow link would deliver it, and with a preview prefix
+// writes the image as it stands after every pass
+int decodeProgressive(const char* input, const char* output, const char* previews) {
+    FILE* fp = fopen(input, "rb");
+    if (!fp) {
+        printf("%s: %s\n", input, errorMessages[OpenFileError]);
+        return 1;
+    }
+    fseek(fp, 0, SEEK_END);
+    long total = ftell(fp);
+    fseek(fp, 0, SEEK_SET);
 
-    image->pixelsAdded = 0;
+    ProgressiveDecoder dec = { .pass = -1 };
+    unsigned char piece[16384];
     err = NoError;
+    while (dec.pass < 7 && err == NoError) {
+        size_t n = fread(piece, 1, sizeof(piece), fp);
+        if (n == 0) break;
+        feedProgressive(&dec, piece, n);
+        while (err == NoError && advanceProgressive(&dec)) {
+            printf("pass %d complete after %ld bytes (%.1f%%)\n", dec.pass, dec.pos, total ? 100.0 * dec.pos / total : 100.0);
+            if (previews) {
+                char filename[4096];
+                snprintf(filename, sizeof(filename), "%s_%d.png", previews, dec.pass);
+                saveAsPngFile((char*) dec.image, dec.width, dec.height, filename);
+            }
+        }
+    }
+    fclose(fp);
+    if (err == NoError && dec.pass < 7) err = TruncatedError;
+    if (err == NoError) saveAsPngFile((char*) dec.image, dec.width, dec.height, (char*) output);
+    free(dec.data);
+    free(dec.image);
+    if (err != NoError) {
+        printf("%s\n", errorMessages[err]);
+        return 1;
+    }
+    return 0;
 }
 
 
-void saveAsPngFile(char* rgbaPixelsStart, int width, int height, char* filename) {
-    FILE *fp = fopen(filename, "wb");
-    if (!fp) {
-        err = OpenFileError;
-        return;
+// Batch decoder (decode --batch), the counterpart of encode --batch for piles of tiny
+// images. A batch of files is read into one buffer, every stream is validated up front,
+// and decodeBatch expands them into one pixel buffer. Both buffers are kept between
+// batches; the png write struct of every output is not, libpng can't reset one.
+#define BATCH_IMAGES 256
+
+// Grows *buffer to hold at least size bytes, keeping its contents. 0 if out of memory.
+int reserveBuffer( unsigned char** buffer, long* capacity, long size ) {
+    if (size <= *capacity) return 1;
+    *capacity = size * 2;
+    *buffer = realloc(*buffer, *capacity);
+    return *buffer != NULL;
+}
+
+
+// decode --batch: returns the process exit code
+int decodeBatchFiles( FileList *files, const char* outdir ) {
+    unsigned char* in = NULL;    // the files of one batch, back to back
+    long inSize = 0;
+    PixelRGBA* out = NULL;       // their pixels, back to back
+    long outSize = 0;
+    long offsets[BATCH_IMAGES + 1];
+    long pixelOffsets[BATCH_IMAGES + 1];
+    long pixels[BATCH_IMAGES];
+    long source[BATCH_IMAGES];
+    int widths[BATCH_IMAGES], heights[BATCH_IMAGES];
+    unsigned char* inputs[BATCH_IMAGES];
+    PixelRGBA* outputs[BATCH_IMAGES];
+    long converted = 0, failed = 0, decoded = 0, decodedPixels = 0;
+    double decodeSeconds = 0;
+
+    if (files->count == 0) {
+        printf("No files to convert\n");
+        return 0;
     }
+    if (countNameClashes(files)) return 1;
+
+    struct timespec start, step;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    for (long first = 0; first < files->count; first += BATCH_IMAGES) {
+        int count = 0;
+        offsets[0] = pixelOffsets[0] = 0;
+        for (long f = first; f < files->count && f < first + BATCH_IMAGES; f++) {
+            const char* name = files->names[f];
+            FILE* fp = fopen(name, "rb");
+            if (!fp) {
+                printf("%s: %s\n", name, errorMessages[OpenFileError]);
+                failed++;
+                continue;
+            }
+            fseek(fp, 0, SEEK_END);
+            long length = ftell(fp);
+            fseek(fp, 0, SEEK_SET);
+            if (!reserveBuffer(&in, &inSize, offsets[count] + length)) {
+                printf("%s\n", errorMessages[MemAllocError]);
+                return 1;
+            }
+            unsigned char* data = in + offsets[count];
+            enum Error problem = length >= 0 && fread(data, 1, length, fp) == (size_t) length ? NoError : ReadFileError;
+            fclose(fp);
+            long declared = problem == NoError && length >= 8 && memcmp(data, "qoiz", 4) == 0 ? qoizLength(data, length) : 0;
+            if (declared < 0) problem = LzError;
+            else if (declared > 0) {
+                // unpacked behind the file, then moved into its place
+                if (!reserveBuffer(&in, &inSize, offsets[count] + length + declared)) {
+                    printf("%s\n", errorMessages[MemAllocError]);
+                    return 1;
+                }
+                data = in + offsets[count];
+                long unpacked = unpackQoiz(data, length, data + length);
+                if (unpacked < 0) problem = LzError;
+                else memmove(data, data + length, unpacked);
+                length = unpacked;
+            }
+            long offset, covered;
+            if (problem == NoError) problem = validateQoif(data, length, &offset, &covered);
+            if (problem != NoError) {
+                printf("%s: %s\n", name, errorMessages[problem]);
+                failed++;
+                continue;
+            }
+            widths[count] = getBE32(data + 4);
+            heights[count] = getBE32(data + 8);
+            pixels[count] = covered;
+            source[count] = f;
+            offsets[count+1] = offsets[count] + length;
+            pixelOffsets[count+1] = pixelOffsets[count] + covered;
+            count++;
+        }
 
-    // Initialize the PNG structures
-    png_structp png = png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
-    if (!png) {
-        err = PngError;
-        fclose(fp);
-        return;
+        if (pixelOffsets[count] > outSize) {
+            free(out);
+            outSize = pixelOffsets[count] * 2;
+            out = malloc(outSize * sizeof(PixelRGBA));
+            if (!out) {
+                printf("%s\n", errorMessages[MemAllocError]);
+                return 1;
+            }
+        }
+        for (int i = 0; i < count; i++) {
+            inputs[i] = in + offsets[i] + 14;
+            outputs[i] = out + pixelOffsets[i];
+        }
+
+        clock_gettime(CLOCK_MONOTONIC, &step);
+        decodeBatch(inputs, pixels, count, outputs);
+        decodeSeconds += secondsSince(step);
+        decoded += count;
+        decodedPixels += pixelOffsets[count];
+
+        for (int i = 0; i < count; i++) {
+            char name[4096], path[8192];
+            spriteName(files->names[source[i]], name, sizeof(name));
+            snprintf(path, sizeof(path), "%s/%s.png", outdir, name);
+            saveAsPngFile((char*) outputs[i], widths[i], heights[i], path);
+            if (err != NoError) {
+                printf("%s: %s\n", path, errorMessages[err]);
+                failed++;
+            }
+            else converted++;
+        }
     }
+    free(in);
+    free(out);
+
+    double seconds = secondsSince(start);
+    printf("%ld images converted, %ld failed in %.3f s: %.1f images/s; decoding alone %.3f s, %.1f images/s, %.1f MP/s\n",
+        converted, failed, seconds, converted / seconds,
+        decodeSeconds, decoded / decodeSeconds, decodedPixels / 1e6 / decodeSeconds);
+    return failed ? 1 : 0;
+}
 
-    png_infop info = png_create_info_struct(png);
-    if (!info) {
-        err = PngError;
-        png_destroy_write_struct(&png, NULL);
-        fclose(fp);
-        return;
+// Header scanner (decode --scan): dimensions, channels and colorspace of every .qoi
+// below the given paths, from the first SCAN_HEAD bytes only, and with --tail also whether
+// the file ends in the end marker. Workers share a stack of directories to read,
+// and each one collects the files it finds in batches. The reads and closes of a
+// whole batch go to the kernel in one io_uring submission; without a ring they are
+// plain preads. Output is CSV or one JSON object per line, buffered per worker.
+
+#define SCAN_BATCH 64
+#define SCAN_HEAD 64 // enough for the 14-byte header, and to unpack it from a qoiz file
+
+typedef struct {
+    FileList* files;     // paths given directly, taken before any directory
+    long nextFile;       // shared work counter
+    char** dirs;         // directories not read yet
+    long dirCount;
+    long dirCapacity;
+    int busy;            // workers reading a directory, which may push more
+    int tail;
+    int json;
+    int useUring;
+    long scanned;
+    long invalid;
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+} ScanJob;
+
+typedef struct {
+    ScanJob* job;
+    char* paths[SCAN_BATCH];
+    int fds[SCAN_BATCH];
+    long sizes[SCAN_BATCH];
+    int results[SCAN_BATCH][2]; // bytes read for header and tail
+    unsigned char header[SCAN_BATCH][SCAN_HEAD];
+    unsigned char marker[SCAN_BATCH][8];
+    int count;
+    IoRing ring;
+    int hasRing;
+    unsigned closing;           // CLOSE requests not reaped yet
+    char out[65536];
+    long outLength;
+} ScanBatch;
+
+void flushScanOutput(ScanBatch *batch) {
+    pthread_mutex_lock(&batch->job->lock);
+    fwrite(batch->out, 1, batch->outLength, stdout);
+    pthread_mutex_unlock(&batch->job->lock);
+    batch->outLength = 0;
+}
+
+// Appends to the worker's output, quoting the way CSV or JSON wants
+void putScanText(ScanBatch *batch, const char* text, int quote) {
+    if (batch->outLength > (long) sizeof(batch->out) - 16384) flushScanOutput(batch);
+    char* out = batch->out + batch->outLength;
+    char* end = batch->out + sizeof(batch->out) - 8;
+    if (quote) *out++ = '"';
+    for (const char* c = text; *c && out < end; c++) {
+        if (quote && batch->job->json && (*c == '"' || *c == '\\')) *out++ = '\\';
+        if (quote && !batch->job->json && *c == '"') *out++ = '"';
+        if (quote && batch->job->json && (unsigned char) *c < 0x20) {
+            out += sprintf(out, "\\u%04x", *c);
+            continue;
+        }
+        *out++ = *c;
     }
+    if (quote) *out++ = '"';
+    batch->outLength = out - batch->out;
+}
 
-    if (setjmp(png_jmpbuf(png))) {
-        err = PngError;
-        png_destroy_write_struct(&png, &info);
-        fclose(fp);
-        return;
+void reportScannedFile(ScanBatch *batch, int i) {
+    ScanJob* job = batch->job;
+    unsigned char* h = batch->header[i];
+    unsigned char unpacked[14];
+    int packed = batch->results[i][0] >= 4 && memcmp(h, "qoiz", 4) == 0;
+    int headerRead = packed ? peekQoizHeader(h, batch->results[i][0], unpacked) : batch->results[i][0] >= 14;
+    if (packed) h = unpacked;
+    const char* status = "ok";
+    if (batch->fds[i] < 0) status = "unreadable";
+    else if (!headerRead || memcmp(h, "qoif", 4) != 0 ||
+             (h[12] != 3 && h[12] != 4) || h[13] > 1) status = "bad-header";
+    // the end marker of a qoiz file is inside its last block, out of reach for --tail
+    else if (job->tail && !packed && (batch->results[i][1] != 8 || memcmp(batch->marker[i], "\0\0\0\0\0\0\0\1", 8) != 0)) status = "no-end-marker";
+    int ok = status[0] == 'o';
+
+    // whatever header was read goes out, so a bad file can still be told apart
+    char line[256];
+    if (job->json) {
+        putScanText(batch, "{\"path\": ", 0);
+        putScanText(batch, batch->paths[i], 1);
+        if (headerRead && batch->fds[i] >= 0) snprintf(line, sizeof(line), ", \"width\": %u, \"height\": %u, \"channels\": %d, \"colorspace\": %d, \"bytes\": %ld, \"status\": \"%s\"}\n",
+            getBE32(h+4), getBE32(h+8), h[12], h[13], batch->sizes[i], status);
+        else if (batch->sizes[i] >= 0) snprintf(line, sizeof(line), ", \"bytes\": %ld, \"status\": \"%s\"}\n", batch->sizes[i], status);
+        else snprintf(line, sizeof(line), ", \"status\": \"%s\"}\n", status);
     }
+    else {
+        int quote = strpbrk(batch->paths[i], ",\"\n") != NULL;
+        putScanText(batch, batch->paths[i], quote);
+        if (headerRead && batch->fds[i] >= 0) snprintf(line, sizeof(line), ",%u,%u,%d,%d,%ld,%s\n", getBE32(h+4), getBE32(h+8), h[12], h[13], batch->sizes[i], status);
+        else if (batch->sizes[i] >= 0) snprintf(line, sizeof(line), ",,,,,%ld,%s\n", batch->sizes[i], status);
+        else snprintf(line, sizeof(line), ",,,,,,%s\n", status);
+    }
+    putScanText(batch, line, 0);
 
-    // Set the output file
-    png_init_io(png, fp);
+    __atomic_fetch_add(&job->scanned, 1, __ATOMIC_RELAXED);
+    if (!ok) __atomic_fetch_add(&job->invalid, 1, __ATOMIC_RELAXED);
+}
 
-    // Write the PNG header info (color type: PNG_COLOR_TYPE_RGBA)
-    png_set_IHDR(png, info, width, height, 8, PNG_COLOR_TYPE_RGBA,
-                 PNG_INTERLACE_NONE, PNG_COMPRESSION_TYPE_DEFAULT, PNG_FILTER_TYPE_DEFAULT);
+// userData: file index * 2 + 0 for the header, + 1 for the tail; closes are marked by bit 32.
+// Returns -1 once the ring fails, the reads not reaped by then are left at -1.
+int reapScanCompletions(ScanBatch *batch, unsigned reads, int wait) {
+    while (reads > 0 || (wait && batch->closing > 0)) {
+        uint64_t userData;
+        int result;
+        if (!reapCompletion(&batch->ring, &userData, &result)) {
+            if (submitAndWait(&batch->ring, 1) != 0) return -1;
+            continue;
+        }
+        if (userData >> 32) {
+            // an old kernel without IORING_OP_CLOSE leaves the descriptor open
+            if (result < 0 && result != -EBADF) close((int) (userData & 0xffffffff));
+            batch->closing--;
+            continue;
+        }
+        batch->results[userData / 2][userData % 2] = result;
+        reads--;
+    }
+    return 0;
+}
 
-    png_write_info(png, info);
+// Without the ring, or after it failed, reads whatever the ring didn't
+void readScanFilesSync(ScanBatch *batch) {
+    for (int i = 0; i < batch->count; i++) {
+        if (batch->fds[i] < 0) continue;
+        if (batch->results[i][0] < 0) batch->results[i][0] = pread(batch->fds[i], batch->header[i], SCAN_HEAD, 0);
+        if (batch->job->tail && batch->sizes[i] >= 22 && batch->results[i][1] < 0) {
+            batch->results[i][1] = pread(batch->fds[i], batch->marker[i], 8, batch->sizes[i] - 8);
+        }
+        close(batch->fds[i]);
+    }
+}
 
-    // Write the pixel data
-    png_bytep rows[height];
-    for (int y = 0; y < height; y++) {
-        rows[y] = (png_bytep)(rgbaPixelsStart + y * width * 4); // RGBA is 4 bytes per pixel
+// Once the ring fails the worker goes on with pread. Closes it had queued but not
+// submitted are lost, which leaves at most one batch of descriptors open.
+void dropScanRing(ScanBatch *batch) {
+    fprintf(stderr, "io_uring: %s, going on with pread\n", strerror(errno));
+    closeIoRing(&batch->ring);
+    batch->hasRing = 0;
+    batch->closing = 0;
+}
+
+void flushScanBatch(ScanBatch *batch) {
+    ScanJob* job = batch->job;
+    unsigned reads = 0;
+    for (int i = 0; i < batch->count; i++) {
+        batch->fds[i] = open(batch->paths[i], O_RDONLY);
+        batch->sizes[i] = -1;
+        batch->results[i][0] = batch->results[i][1] = -1;
+        if (batch->fds[i] < 0) continue;
+        struct stat st;
+        if (fstat(batch->fds[i], &st) == 0) batch->sizes[i] = st.st_size;
+        int readTail = job->tail && batch->sizes[i] >= 22;
+        if (batch->hasRing) {
+            queueIo(&batch->ring, IORING_OP_READ, batch->fds[i], batch->header[i], SCAN_HEAD, 0, 0, i*2);
+            reads++;
+            if (readTail) {
+                queueIo(&batch->ring, IORING_OP_READ, batch->fds[i], batch->marker[i], 8, batch->sizes[i] - 8, 0, i*2 + 1);
+                reads++;
+            }
+        }
+    }
+    if (batch->hasRing && (submitAndWait(&batch->ring, 0) != 0 || reapScanCompletions(batch, reads, 0) != 0)) {
+        dropScanRing(batch);
+    }
+    if (batch->hasRing) {
+        // the closes ride along with the next submission
+        for (int i = 0; i < batch->count; i++) {
+            if (batch->fds[i] < 0) continue;
+            queueIo(&batch->ring, IORING_OP_CLOSE, batch->fds[i], NULL, 0, 0, 0, (1ULL << 32) | batch->fds[i]);
+            batch->closing++;
+        }
+    }
+    else {
+        readScanFilesSync(batch);
     }
-    png_write_image(png, rows);
+    for (int i = 0; i < batch->count; i++) {
+        reportScannedFile(batch, i);
+        free(batch->paths[i]);
+    }
+    batch->count = 0;
+}
 
-    // End the writing process
-    png_write_end(png, NULL);
+void addToScanBatch(ScanBatch *batch, const char* path) {
+    batch->paths[batch->count++] = strdup(path);
+    if (batch->count == SCAN_BATCH) flushScanBatch(batch);
+}
 
-    // Clean up
-    png_destroy_write_struct(&png, &info);
-    fclose(fp);
-    err = NoError;
+void pushScanDirectory(ScanJob *job, const char* path) {
+    pthread_mutex_lock(&job->lock);
+    if (job->dirCount == job->dirCapacity) {
+        job->dirCapacity = job->dirCapacity ? job->dirCapacity*2 : 256;
+        job->dirs = realloc(job->dirs, job->dirCapacity * sizeof(char*));
+    }
+    job->dirs[job->dirCount++] = strdup(path);
+    pthread_cond_signal(&job->wake);
+    pthread_mutex_unlock(&job->lock);
 }
 
+void scanDirectory(ScanBatch *batch, const char* path) {
+    DIR* dir = opendir(path);
+    if (!dir) return;
+    struct dirent* entry;
+    char child[4096];
+    while ((entry = readdir(dir)) != NULL) {
+        if (entry->d_name[0] == '.') continue;
+        snprintf(child, sizeof(child), "%s/%s", path, entry->d_name);
+        struct stat st;
+        if (entry->d_type == DT_DIR || (entry->d_type == DT_UNKNOWN && stat(child, &st) == 0 && S_ISDIR(st.st_mode))) {
+            pushScanDirectory(batch->job, child);
+        }
+        else if (hasExtension(entry->d_name, ".qoi")) {
+            addToScanBatch(batch, child);
+        }
+    }
+    closedir(dir);
+}
+
+void* scanWorker(void* arg) {
+    ScanJob* job = arg;
+    ScanBatch* batch = calloc(1, sizeof(ScanBatch));
+    if (!batch) return NULL;
+    batch->job = job;
+    batch->hasRing = job->useUring && openIoRing(&batch->ring, 4*SCAN_BATCH) == 0;
+
+    while (1) {
+        long i = __atomic_fetch_add(&job->nextFile, 1, __ATOMIC_RELAXED);
+        if (i >= job->files->count) break;
+        addToScanBatch(batch, job->files->names[i]);
+    }
+
+    pthread_mutex_lock(&job->lock);
+    while (1) {
+        while (job->dirCount == 0 && job->busy > 0) pthread_cond_wait(&job->wake, &job->lock);
+        if (job->dirCount == 0) break;
+        char* path = job->dirs[--job->dirCount];
+        job->busy++;
+        pthread_mutex_unlock(&job->lock);
+
+        scanDirectory(batch, path);
+        free(path);
+
+        pthread_mutex_lock(&job->lock);
+        job->busy--;
+    }
+    pthread_cond_broadcast(&job->wake); // everyone else is done too
+    pthread_mutex_unlock(&job->lock);
+
+    if (batch->count > 0) flushScanBatch(batch);
+    if (batch->hasRing) {
+        if (submitAndWait(&batch->ring, 0) != 0 || reapScanCompletions(batch, 0, 1) != 0) dropScanRing(batch);
+        else closeIoRing(&batch->ring);
+    }
+    flushScanOutput(batch);
+    free(batch);
+    return NULL;
+}
+
+int scanFiles(char** paths, int count, ScanJob *job, int threads) {
+    FileList files = {0};
+    job->files = &files;
+    pthread_mutex_init(&job->lock, NULL);
+    pthread_cond_init(&job->wake, NULL);
+    for (int i = 0; i < count; i++) {
+        struct stat st;
+        if (stat(paths[i], &st) == 0 && S_ISDIR(st.st_mode)) pushScanDirectory(job, paths[i]);
+        else addToFileList(&files, paths[i]);
+    }
+    if (threads < 1) threads = 1;
 
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    if (job->json == 0) puts("path,width,height,channels,colorspace,bytes,status");
+    fflush(stdout);
 
+    pthread_t workers[threads];
+    for (int i = 0; i < threads; i++) pthread_create(&workers[i], NULL, scanWorker, job);
+    for (int i = 0; i < threads; i++) pthread_join(workers[i], NULL);
+
+    double seconds = secondsSince(start);
+    fprintf(stderr, "%ld files, %ld invalid, %.3f s, %.0f files/s\n",
+        job->scanned, job->invalid, seconds, seconds > 0 ? job->scanned / seconds : 0);
+    return job->invalid ? 1 : 0;
+}
 
 int main(int argc, char** argv) {
 
-    if (argc != 3) {
-        puts("Usage: decode filename.qoi outputname.png");
+    char* files[argc];
+    int fileCount = 0;
+    int statsFormat = 0; // 0 = off, 1 = text, 2 = JSON
+    Stats collected = {0};
+    int validate = 0;
+    int pack = 0;
+    int bulk = 0;
+    int watch = 0;
+    int sequence = 0;
+    Layout layout = { .format = -1, .scale = {1,1,1,1}, .colorspace = -1, .order = {0,1,2,3} };
+    Analytics gathered;
+    int analyze = 0;
+    int scan = 0;
+    int progressive = 0;
+    int batch = 0;
+    char* previews = NULL;
+    ScanJob scanJob = { .useUring = 1 };
+    int threads = sysconf(_SC_NPROCESSORS_ONLN);
+    BulkJob job = { .extension = ".png", .convert = convertBuffer, .queueDepth = 16, .bufferSize = 1<<20, .useUring = 1 };
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--stats") == 0) statsFormat = 1;
+        else if (strcmp(argv[i], "--stats=json") == 0) statsFormat = 2;
+        else if (strcmp(argv[i], "--validate") == 0) validate = 1;
+        else if (strcmp(argv[i], "--pack") == 0) pack = 1;
+        else if (strcmp(argv[i], "--bulk") == 0) bulk = 1;
+        else if (strcmp(argv[i], "--watch") == 0) watch = 1;
+        else if (strcmp(argv[i], "--sequence") == 0) sequence = 1;
+        else if (strcmp(argv[i], "--analytics") == 0) analyze = 1;
+        else if (strcmp(argv[i], "--layout") == 0 && i+1 < argc) {
+            i++;
+            if (strcmp(argv[i], "rgba") == 0) layout.format = 0;
+            else if (strcmp(argv[i], "planar") == 0) layout.format = 1;
+            else if (strcmp(argv[i], "chw") == 0) layout.format = 2;
+            else layout.format = -2;
+        }
+        else if (strcmp(argv[i], "--pitch") == 0 && i+1 < argc) layout.pitch = atol(argv[++i]);
+        else if (strcmp(argv[i], "--channels") == 0 && i+1 < argc) layout.channels = atoi(argv[++i]) == 3 ? 3 : 4;
+        else if (strcmp(argv[i], "--scale") == 0 && i+1 < argc) parseChannelValues(argv[++i], layout.scale);
+        else if (strcmp(argv[i], "--bias") == 0 && i+1 < argc) parseChannelValues(argv[++i], layout.bias);
+        else if (strcmp(argv[i], "--linear") == 0) layout.colorspace = 1;
+        else if (strcmp(argv[i], "--srgb") == 0) layout.colorspace = 0;
+        else if (strcmp(argv[i], "--premultiply") == 0) layout.premultiply = 1;
+        else if (strcmp(argv[i], "--swizzle") == 0 && i+1 < argc) {
+            if (!parseSwizzle(argv[++i], layout.order)) layout.format = -2;
+        }
+        else if (strcmp(argv[i], "-j") == 0 && i+1 < argc) threads = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--queue-depth") == 0 && i+1 < argc) job.queueDepth = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--scan") == 0) scan = 1;
+        else if (strcmp(argv[i], "--progressive") == 0) progressive = 1;
+        else if (strcmp(argv[i], "--batch") == 0) batch = 1;
+        else if (strcmp(argv[i], "--previews") == 0 && i+1 < argc) previews = argv[++i];
+        else if (strcmp(argv[i], "--tail") == 0) scanJob.tail = 1;
+        else if (strcmp(argv[i], "--csv") == 0) scanJob.json = 0;
+        else if (strcmp(argv[i], "--json") == 0) scanJob.json = 1;
+        else if (strcmp(argv[i], "--io=sync") == 0) job.useUring = scanJob.useUring = 0;
+        else if (strcmp(argv[i], "--io=uring") == 0) job.useUring = scanJob.useUring = 1;
+        else files[fileCount++] = argv[i];
+    }
+
+    if (validate && fileCount > 0) {
+        FileList validateList = {0};
+        for (int i = 0; i < fileCount; i++) collectFiles(files[i], ".qoi", &validateList);
+        return validateFiles(&validateList, threads);
+    }
+    if (pack && fileCount >= 2) {
+        return unpackFiles(files[0], files[1], files+2, fileCount-2, threads);
+    }
+    if (bulk && fileCount >= 2) {
+        FileList inputs = {0};
+        for (int i = 1; i < fileCount; i++) collectFiles(files[i], ".qoi", &inputs);
+        job.files = &inputs;
+        job.outdir = files[0];
+        return convertFiles(&job, threads);
+    }
+    if (watch && fileCount == 2) {
+        WatchJob watching = { files[0], files[1], ".qoi", ".png", convertSpooledQoi };
+        return watchDirectory(&watching, threads);
+    }
+    if (sequence && fileCount == 2) {
+        return decodeSequence(files[0], files[1]);
+    }
+    if (progressive && fileCount == 2) {
+        return decodeProgressive(files[0], files[1], previews);
+    }
+    if (batch && fileCount >= 2) {
+        FileList inputs = {0};
+        for (int i = 1; i < fileCount; i++) collectFiles(files[i], ".qoi", &inputs);
+        return decodeBatchFiles(&inputs, files[0]);
+    }
+    if (scan && fileCount > 0) {
+        return scanFiles(files, fileCount, &scanJob, threads);
+    }
+    if (statsFormat) stats = &collected;
+    if (layout.format >= 0 && fileCount == 2) {
+        return decodeWithLayout(files[0], files[1], &layout, 0, statsFormat, analyze);
+    }
+    if (layout.format == -1 && needsConversion(&layout, -1) && fileCount == 2) { // -1: not read yet
+        layout.format = 0;
+        return decodeWithLayout(files[0], files[1], &layout, 1, statsFormat, analyze);
+    }
+    if (validate || pack || bulk || watch || sequence || scan || progressive || batch || layout.format != -1 || fileCount != 2) {
+        puts("Usage: decode [--stats[=json]] [--analytics] [--linear|--srgb] [--premultiply] [--swizzle order] filename.qoi outputname.png");
+        puts("       decode --validate [-j threads] filename.qoi|directory ...");
+        puts("       decode --pack [-j threads] filename.qpak outputdir [name ...]");
+        puts("       decode --bulk [-j threads] [--queue-depth n] [--io=uring|sync] outputdir filename.qoi|directory ...");
+        puts("       decode --watch [-j threads] spooldir outputdir");
+        puts("       decode --sequence filename.qseq outputprefix");
+        puts("       decode --progressive [--previews outputprefix] filename.qprg outputname.png");
+        puts("       decode --batch outputdir filename.qoi|directory ...");
+        puts("       decode --scan [-j threads] [--tail] [--csv|--json] [--io=uring|sync] filename.qoi|directory ...");
+        puts("       decode --layout rgba|planar|chw [--stats[=json]] [--analytics] [--pitch bytes] [--channels 3|4] [--scale s] [--bias b]");
+        puts("              [--linear|--srgb] [--premultiply] [--swizzle order] filename.qoi outputname.raw");
         return 1;
     }
 
-    RawImage raw;
-    QoifImage qoif;
-    PixelRGBA palette[64] = {0};
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
 
-    readQoifFile(argv[1], &qoif, &raw);
+    PixelBuffer raw;
+    QoifStream qoif;
+
+    long fileBytes = readQoifFile(files[0], &qoif, &raw);
 
     if (err != NoError) {
         printf("%s\n", errorMessages[err]);
         return 1;
     }
+    if (stats) {
+        stats->seconds[0] = secondsSince(start);
+        clock_gettime(CLOCK_MONOTONIC, &start);
+    }
 
-    while(1) {
-        if (qoif.bytesProcessed + 8 >= qoif.totalLengthInBytes) break;
-        if (raw.pixelsAdded >= qoif.width * qoif.height) break;
-
-
-        QoifChunk chunk = fetchNextChunk(&qoif, raw, palette);
-        if (chunk.type == 0) writeChunkRGB(&raw, chunk);
-        if (chunk.type == 1) writeChunkRGBA(&raw, chunk);
-        if (chunk.type == 2) writeChunkINDEX(&raw, chunk, palette);
-        if (chunk.type == 3) writeChunkDIFF(&raw, chunk);
-        if (chunk.type == 4) writeChunkLUMA(&raw, chunk);
-        if (chunk.type == 5) writeChunkRUN(&raw, chunk);
-        if (chunk.type == 6) break;
-
-        PixelRGBA* lastPixel = ((PixelRGBA*) raw.data) + raw.pixelsAdded - 1;
-        addToPalette(*lastPixel, palette);
+    if (analyze) {
+        startAnalytics(&gathered, qoif.width, qoif.height);
+        analytics = &gathered;
+    }
+    decodeBody(&qoif, &raw);
+    if (err != NoError) {
+        printf("%s\n", errorMessages[err]);
+        return 1;
+    }
+    if (stats) {
+        stats->seconds[1] = secondsSince(start);
+        clock_gettime(CLOCK_MONOTONIC, &start);
     }
 
-    saveAsPngFile((char*) raw.data, qoif.width, qoif.height, argv[2]);
+    saveAsPngFile((char*) raw.data, qoif.width, qoif.height, files[1]);
+    if (analytics && err == NoError) saveAnalytics(analytics, files[1]);
 
     if (err != NoError) {
         printf("%s\n", errorMessages[err]);
         return 1;
     }
+    if (stats) {
+        stats->seconds[2] = secondsSince(start);
+        printStats(stats, statsFormat==2, (long) qoif.width * qoif.height, fileBytes, "decode");
+    }
     return 0;
 }
-
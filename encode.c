@@ -2,455 +2,772 @@
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
 #include <png.h>
+#include "qoi.h"
+#include "qoiEncoder.h"
+#include "ioRing.h"
+#include "watch.h"
 
+void saveToFile( QoifImage qoif, char* filename ) {
+    FILE* file = fopen(filename, "wb");
+    if (!file) {
+        err = OpenFileError;
+        return;
+    }
+    size_t written = fwrite(qoif.data, 1, qoif.bytesAdded, file);
+    if (written != qoif.bytesAdded) {
+        err = WriteFileError;
+        fclose(file);
+        return;
+    }
+    fclose(file);
+    err = NoError;
+    return;
+}
 
-typedef struct {
-    char magic[4]; // magic bytes "qoif"
-    char width[4]; // image width in pixels (BE)
-    char height[4]; // image height in pixels (BE)
-    uint8_t channels; // 3 = RGB, 4 = RGBA
-    uint8_t colorspace; // 0 = sRGB with linear alpha
-    // 1 = all channels linear
-} QoifHeader;
-
-typedef struct {
-    unsigned char r, g, b, a;
-} PixelRGBA;
-
-typedef struct {
-    unsigned char* data;
-    long bytesAdded;
-} QoifImage;
+// Sprite pack ("qpak"): many small images in one file behind a hash index.
+//   header   magic "qpak", entry count, table slots (a power of two), all BE
+//   table    32 bytes per slot: name hash (64), offset (64), length, width, height, name offset
+//            an empty slot has hash 0, lookups probe linearly from hash % slots
+//   names    NUL-terminated sprite names
+//   sprites  complete .qoi streams, one per entry
 
-typedef struct {
-    unsigned char* data;  // Pointer to RGB or RGBA data
-    int width;
-    int height;
-    int channels;         // 3 for RGB, 4 for RGBA
-    long totalLengthInPixels;
-    long pixelsProcessed; // 0
-} RawImage;
 
-typedef struct {
-    unsigned char r, g, b;
-} ChunkRGB;
+void putBE64(unsigned char* dst, uint64_t value) {
+    putBE32(dst, value >> 32);
+    putBE32(dst + 4, value);
+}
 
-typedef struct {
-    unsigned char r, g, b, a;
-} ChunkRGBA;
 
-typedef struct {
-    char index;
-} ChunkINDEX;
+// encode --pack: returns the process exit code
+int packPngFiles(FileList *files, const char* output) {
+    char** inputs = files->names;
+    long count = files->count;
+    uint32_t slots = 2;
+    while (slots < 2L*count) slots *= 2;
+
+    long tableSize = 12 + 32L*slots;
+    long namesSize = 0;
+    char name[4096];
+    for (int i = 0; i<count; i++) {
+        spriteName(inputs[i], name, sizeof(name));
+        if (!isSafeName(name)) {
+            printf("%s: invalid sprite name %s\n", inputs[i], name);
+            return 1;
+        }
+        namesSize += strlen(name) + 1;
+    }
 
-typedef struct {
-    signed char dr, dg, db;
-} ChunkDIFF;
+    unsigned char* index = calloc(tableSize + namesSize, 1);
+    QoifImage* sprites = calloc(count, sizeof(QoifImage));
+    if (!index || !sprites) {
+        printf("%s\n", errorMessages[MemAllocError]);
+        return 1;
+    }
+    memcpy(index, "qpak", 4);
+    putBE32(index+4, count);
+    putBE32(index+8, slots);
+
+    long nameOffset = tableSize;
+    uint64_t dataOffset = tableSize + namesSize;
+    for (int i = 0; i<count; i++) {
+        RawImage raw;
+        readPngFile(inputs[i], &raw);
+        if (err == NoError) createQoifBuffer(raw, &sprites[i]);
+        if (err != NoError) {
+            printf("%s: %s\n", inputs[i], errorMessages[err]);
+            return 1;
+        }
+        writeHeader(&sprites[i], raw.width, raw.height, raw.channels==4, raw.colorspace);
+        writeBody(&sprites[i], raw);
+        writeFooter(&sprites[i]);
+        free(raw.data);
+
+        spriteName(inputs[i], name, sizeof(name));
+        uint64_t hash = hashName(name);
+        uint32_t slot = hash & (slots-1);
+        unsigned char* entry;
+        while (1) {
+            entry = index + 12 + 32L*slot;
+            uint64_t used = 0;
+            for (int b = 0; b<8; b++) used = (used << 8) | entry[b];
+            if (used == 0) break;
+            uint32_t usedName = (entry[28]<<24) | (entry[29]<<16) | (entry[30]<<8) | entry[31];
+            if (used == hash && strcmp((char*) index + usedName, name) == 0) {
+                printf("%s: duplicate sprite name %s\n", inputs[i], name);
+                return 1;
+            }
+            slot = (slot+1) & (slots-1);
+        }
+        putBE64(entry, hash);
+        putBE64(entry+8, dataOffset);
+        putBE32(entry+16, sprites[i].bytesAdded);
+        putBE32(entry+20, raw.width);
+        putBE32(entry+24, raw.height);
+        putBE32(entry+28, nameOffset);
+        strcpy((char*) index + nameOffset, name);
+        nameOffset += strlen(name) + 1;
+        dataOffset += sprites[i].bytesAdded;
+    }
 
-typedef struct {
-    signed char dg, drdg, dbdg;
-} ChunkLUMA;
+    FILE* file = fopen(output, "wb");
+    if (!file) {
+        printf("%s\n", errorMessages[OpenFileError]);
+        return 1;
+    }
+    int failed = fwrite(index, 1, tableSize + namesSize, file) != (size_t) (tableSize + namesSize);
+    for (int i = 0; i<count && !failed; i++) {
+        failed = fwrite(sprites[i].data, 1, sprites[i].bytesAdded, file) != (size_t) sprites[i].bytesAdded;
+        free(sprites[i].data);
+    }
+    if (fclose(file) != 0) failed = 1;
+    if (failed) {
+        printf("%s\n", errorMessages[WriteFileError]);
+        return 1;
+    }
+    free(index);
+    free(sprites);
+    return 0;
+}
 
-typedef struct {
-    char run;
-} ChunkRUN;
 
-typedef struct {
-    int type; // 0=RGB, 1=RGBA, 2=INDEX, 3=DIFF, 4=LUMA, 5=RUN
-    int pixelsCovered; // 1 for all except RUN
-    union {
-        ChunkRGB RGB;
-        ChunkRGBA RGBA;
-        ChunkINDEX INDEX;
-        ChunkDIFF DIFF;
-        ChunkLUMA LUMA;
-        ChunkRUN RUN;
-    };
-} QoifChunk;
-
-
-enum Error { NoError, OpenFileError, ReadFileError, MemAllocError, PngError, WriteFileError} err;
-
-char* errorMessages[] = {
-    "No errors",
-    "Can't open file",
-    "Can't read file",
-    "Can't allocate enough memory",
-    "Error related to libpng",
-    "Can't write file"
-};
-
-void writeChunkRGB(QoifImage *qoif, QoifChunk chunk) {
-    unsigned char* startAddr = qoif->data + qoif->bytesAdded;
-    startAddr[0] = 0xfe;
-    startAddr[1] = chunk.RGB.r;
-    startAddr[2] = chunk.RGB.g;
-    startAddr[3] = chunk.RGB.b;
-    qoif->bytesAdded += 4;
+// Frame sequence ("qseq"): screen captures and similar streams where consecutive frames
+// are mostly identical. Only the changed span of each row is coded, with QOI chunks
+// predicted either from the same pixels of the previous frame or from the left neighbour.
+//   header   magic "qseq", width, height, frame count (BE)
+//   frame    length of the frame in bytes (BE), then one record per row or run of rows:
+//            0x00 n          n rows unchanged from the previous frame
+//            0x01 x n chunks pixels x .. x+n-1 predicted from the previous frame
+//            0x02 x n chunks pixels x .. x+n-1 predicted from the left neighbour
+//            x and n are LEB128. RUN chunks copy the prediction and don't touch the
+//            palette, every other chunk adds its pixel as usual. The palette starts
+//            empty in every frame and the frame before the first is all zero.
+
+void writeVarint(QoifImage *out, unsigned long value) {
+    while (value >= 0x80) {
+        out->data[out->bytesAdded++] = (value & 0x7f) | 0x80;
+        value >>= 7;
+    }
+    out->data[out->bytesAdded++] = value;
 }
 
-void writeChunkRGBA(QoifImage *qoif, QoifChunk chunk) {
-    unsigned char* startAddr = qoif->data + qoif->bytesAdded;
-    startAddr[0] = 0xff;
-    startAddr[1] = chunk.RGBA.r;
-    startAddr[2] = chunk.RGBA.g;
-    startAddr[3] = chunk.RGBA.b;
-    startAddr[4] = chunk.RGBA.a;
-    qoif->bytesAdded += 5;
+// Codes cur[0..n-1] either against ref (the previous frame) or against the left neighbour
+void writeSpan(QoifImage *out, PixelRGBA* cur, PixelRGBA* ref, long n, int temporal, PixelRGBA left, PixelRGBA palette[64]) {
+    long i = 0;
+    while (i < n) {
+        PixelRGBA pred = temporal ? ref[i] : (i ? cur[i-1] : left);
+        if (isSamePixel(cur[i], pred)) {
+            int run = 1;
+            while (run < 62 && i+run < n && isSamePixel(cur[i+run], temporal ? ref[i+run] : pred)) run++;
+            writeChunk(out, (QoifChunk) { .type = 5, .pixelsCovered = run, .RUN = { .run = run } });
+            i += run;
+            continue;
+        }
+        writeChunk(out, decidePixelChunk(cur[i], pred, 4, palette));
+        addToPalette(cur[i], palette);
+        i++;
+    }
 }
 
-void writeChunkINDEX(QoifImage *qoif, QoifChunk chunk) {
-    // Note: assuming index<64. Safe if not.
-    unsigned char* startAddr = qoif->data + qoif->bytesAdded;
-    startAddr[0] = chunk.INDEX.index;
-    startAddr[0] &= 0x3f;
-    qoif->bytesAdded += 1;
-}
+void writeFrame(QoifImage *out, PixelRGBA* frame, PixelRGBA* previous, int width, int height, QoifImage *scratch) {
+    PixelRGBA palette[64] = {0};
+    PixelRGBA spatialPalette[64];
+    long unchangedRows = 0;
+
+    for (long y = 0; y < height; y++) {
+        PixelRGBA* row = frame + y*width;
+        PixelRGBA* ref = previous + y*width;
+        long first = 0, last = width;
+        while (first < width && isSamePixel(row[first], ref[first])) first++;
+        if (first == width) {
+            unchangedRows++;
+            continue;
+        }
+        while (isSamePixel(row[last-1], ref[last-1])) last--;
 
-void writeChunkDIFF(QoifImage *qoif, QoifChunk chunk) {
-    // Note: assuming -2 <= dr,dg,db <= 1. Safe if not.
-    unsigned char* startAddr = qoif->data + qoif->bytesAdded;
-    startAddr[0] = 0x40;
-    startAddr[0] |= ((chunk.DIFF.dr+2) & 0x03) << 4;
-    startAddr[0] |= ((chunk.DIFF.dg+2) & 0x03) << 2;
-    startAddr[0] |= ((chunk.DIFF.db+2) & 0x03);
-    qoif->bytesAdded += 1;
-}
+        if (unchangedRows) {
+            out->data[out->bytesAdded++] = 0x00;
+            writeVarint(out, unchangedRows);
+            unchangedRows = 0;
+        }
 
-void writeChunkLUMA(QoifImage *qoif, QoifChunk chunk) {
-    // Note: assuming -32 <= dg <= 31   and   -8 <= drdg,dbdg <= 7
-    unsigned char* startAddr = qoif->data + qoif->bytesAdded;
-    startAddr[0] = 0x80;
-    startAddr[0] |= ((chunk.LUMA.dg+32) & 0x3f);
-    startAddr[1] = 0;
-    startAddr[1] |= ((chunk.LUMA.drdg+8) & 0x0f) << 4;
-    startAddr[1] |= ((chunk.LUMA.dbdg+8) & 0x0f);
-    qoif->bytesAdded += 2;
-}
+        // try both predictors, keep the shorter one along with its palette
+        PixelRGBA left = first ? row[first-1] : (PixelRGBA){0,0,0,255};
+        memcpy(spatialPalette, palette, sizeof(palette));
+        scratch->bytesAdded = 0;
+        writeSpan(scratch, row+first, ref+first, last-first, 0, left, spatialPalette);
+        long temporalStart = out->bytesAdded;
+        out->data[out->bytesAdded++] = 0x01;
+        writeVarint(out, first);
+        writeVarint(out, last-first);
+        long headerLength = out->bytesAdded - temporalStart;
+        PixelRGBA temporalPalette[64];
+        memcpy(temporalPalette, palette, sizeof(palette));
+        writeSpan(out, row+first, ref+first, last-first, 1, left, temporalPalette);
+
+        if (scratch->bytesAdded < out->bytesAdded - temporalStart - headerLength) {
+            out->bytesAdded = temporalStart;
+            out->data[out->bytesAdded++] = 0x02;
+            writeVarint(out, first);
+            writeVarint(out, last-first);
+            memcpy(out->data + out->bytesAdded, scratch->data, scratch->bytesAdded);
+            out->bytesAdded += scratch->bytesAdded;
+            memcpy(palette, spatialPalette, sizeof(palette));
+        }
+        else {
+            memcpy(palette, temporalPalette, sizeof(palette));
+        }
+    }
 
-void writeChunkRUN(QoifImage *qoif, QoifChunk chunk) {
-    // Note: assuming 1 <= run <= 62. Safe if not.
-    unsigned char* startAddr = qoif->data + qoif->bytesAdded;
-    startAddr[0] = 0xc0;
-    startAddr[0] |= ((chunk.RUN.run-1) & 0x3f);
-    qoif->bytesAdded += 1;
+    if (unchangedRows) {
+        out->data[out->bytesAdded++] = 0x00;
+        writeVarint(out, unchangedRows);
+    }
 }
 
-void writeHeader(QoifImage *qoif, int w, int h, int isRGBA) {
-    QoifHeader* header = (QoifHeader*) (qoif->data + qoif->bytesAdded);
-    header->magic[0] = 'q';
-    header->magic[1] = 'o';
-    header->magic[2] = 'i';
-    header->magic[3] = 'f';
-    header->width[3] = w % 256;
-    header->width[2] = (w/(1<<8)) % 256;
-    header->width[1] = (w/(1<<16)) % 256;
-    header->width[0] = (w/(1<<24)) % 256;
-    header->height[3] = h % 256;
-    header->height[2] = (h/(1<<8)) % 256;
-    header->height[1] = (h/(1<<16)) % 256;
-    header->height[0] = (h/(1<<24)) % 256;
-    header->channels = isRGBA ? 4 : 3;
-    header->colorspace = 1;
-    qoif->bytesAdded += 14;
-}
+// encode --sequence: returns the process exit code
+int encodeSequence(char** inputs, int count, const char* output) {
+    RawImage first;
+    readPngFile(inputs[0], &first);
+    if (err != NoError) {
+        printf("%s: %s\n", inputs[0], errorMessages[err]);
+        return 1;
+    }
+    int width = first.width, height = first.height;
+    long pixels = (long) width * height;
+
+    PixelRGBA* previous = calloc(pixels, sizeof(PixelRGBA));
+    // worst case per row: 5 bytes per pixel plus record header
+    QoifImage frame = { malloc(pixels*5 + (long) height*24 + 16), 0 };
+    QoifImage scratch = { malloc((long) width*5), 0 };
+    FILE* file = fopen(output, "wb");
+    if (!previous || !frame.data || !scratch.data) {
+        printf("%s\n", errorMessages[MemAllocError]);
+        return 1;
+    }
+    if (!file) {
+        printf("%s\n", errorMessages[OpenFileError]);
+        return 1;
+    }
+
+    unsigned char header[16];
+    memcpy(header, "qseq", 4);
+    putBE32(header+4, width);
+    putBE32(header+8, height);
+    putBE32(header+12, count);
+    int failed = fwrite(header, 1, 16, file) != 16;
+
+    RawImage raw = first;
+    for (int i = 0; i < count && !failed; i++) {
+        if (i > 0) {
+            readPngFile(inputs[i], &raw);
+            if (err != NoError) {
+                printf("%s: %s\n", inputs[i], errorMessages[err]);
+                return 1;
+            }
+        }
+        if (raw.width != width || raw.height != height || raw.channels != 4) {
+            printf("%s: frame is %dx%d with %d channels, expected %dx%d RGBA\n",
+                inputs[i], raw.width, raw.height, raw.channels, width, height);
+            return 1;
+        }
 
-void writeFooter(QoifImage *qoif) {
-    unsigned char* startAddr = qoif->data + qoif->bytesAdded;
-    for (int i = 0; i<7; i++) {
-        startAddr[i] = 0;
+        frame.bytesAdded = 4;
+        writeFrame(&frame, (PixelRGBA*) raw.data, previous, width, height, &scratch);
+        putBE32(frame.data, frame.bytesAdded - 4);
+        failed = fwrite(frame.data, 1, frame.bytesAdded, file) != (size_t) frame.bytesAdded;
+
+        free(previous);
+        previous = (PixelRGBA*) raw.data;
     }
-    startAddr[7] = 1;
-    qoif->bytesAdded += 8;
-}
 
-void addToPalette( PixelRGBA pixel, PixelRGBA* palette ) {
-    // Note: assumes minimum 64 length. UB if not.
-    int index = ( pixel.r*3 + pixel.g*5 + pixel.b*7 + pixel.a*11 ) % 64;
-    palette[ index ] = pixel;
+    if (fclose(file) != 0 || failed) {
+        printf("%s\n", errorMessages[WriteFileError]);
+        return 1;
+    }
+    free(previous);
+    free(frame.data);
+    free(scratch.data);
+    return 0;
 }
 
-PixelRGBA getFromPalette( PixelRGBA pixel, PixelRGBA* palette ) {
-    // Note: assumes minimum 64 length. UB if not.
-    int index = ( pixel.r*3 + pixel.g*5 + pixel.b*7 + pixel.a*11 ) % 64;
-    PixelRGBA p = palette[index];
-    return palette[ index ];
-}
 
-int getIndexFromPalette( PixelRGBA pixel, PixelRGBA* palette ) {
-    return ( pixel.r*3 + pixel.g*5 + pixel.b*7 + pixel.a*11 ) % 64;
+// Bulk conversion (encode --bulk), see ioRing.c for the engine
+
+void convertBuffer(unsigned char* in, long length, unsigned char** out, long* outLength) {
+    RawImage raw;
+    readPngBuffer(in, length, &raw);
+    if (err != NoError) return;
+    QoifImage qoif;
+    createQoifBuffer(raw, &qoif);
+    if (err != NoError) {
+        free(raw.data);
+        return;
+    }
+    writeHeader(&qoif, raw.width, raw.height, raw.channels==4, raw.colorspace);
+    writeBody(&qoif, raw);
+    writeFooter(&qoif);
+    free(raw.data);
+    *out = qoif.data;
+    *outLength = qoif.bytesAdded;
 }
 
 
+// Watch mode (encode --watch), see watch.c. libpng can't reset a png_struct for the next
+// image, so those are made for every file; the pixels go to the worker's warm buffer.
 
-void createQoifBuffer( RawImage raw, QoifImage *qoif) {
-    long size = raw.width * raw.height * raw.channels;
-    qoif->data = (unsigned char*)malloc(size*2 + 22); // minimum file size: 22
-    qoif->bytesAdded = 0;
-    if (qoif->data == NULL) {
+void convertSpooledPng(WarmBuffers *warm, long length) {
+    RawImage raw;
+    PngSource source = { warm->in, length, 0 };
+    readPngInto(NULL, &source, &raw, &warm->pixels, &warm->pixelCapacity);
+    if (err != NoError) return;
+    if (!reserveWarm(&warm->out, &warm->outCapacity, qoifBound(raw))) {
         err = MemAllocError;
         return;
     }
+    QoifImage qoif = { warm->out, 0 };
+    writeHeader(&qoif, raw.width, raw.height, raw.channels==4, raw.colorspace);
+    writeBody(&qoif, raw);
+    writeFooter(&qoif);
+    warm->outLength = qoif.bytesAdded;
 }
 
-QoifChunk decideNextChunk( RawImage raw, PixelRGBA palette[64]) {
-    QoifChunk result;
-    // assuming pixelsProcessed != totalLengthInPixels
-    PixelRGBA* cur = ((PixelRGBA*) raw.data) + raw.pixelsProcessed;
-    PixelRGBA* prev;
-    if (raw.pixelsProcessed==0) {
-        prev = &(PixelRGBA){0,0,0,255};
-    }
-    else {
-        prev = cur-1;
-    }
-    int dr = cur->r - prev->r;
-    int dg = cur->g - prev->g;
-    int db = cur->b - prev->b;
-    int da = cur->a - prev->a;
-    if (dr==0 && dg==0 && db==0 && da==0) {
-        PixelRGBA* next = cur+1;
-        while(
-            (next-cur) < 62 &&
-            (next-cur) + raw.pixelsProcessed < raw.totalLengthInPixels &&
-            cur->r == next->r &&
-            cur->g == next->g &&
-            cur->b == next->b &&
-            cur->a == next->a
-        ) {
-            next++;
-        }
-        return (QoifChunk) {
-            .type = 5,
-            .pixelsCovered = next-cur,
-            .RUN = (ChunkRUN) {
-                .run = next-cur
-            }
-        };
-        
-    }
-    PixelRGBA hashed = getFromPalette(*cur, palette);
-    int hashedIndex = getIndexFromPalette(*cur, palette);
-    if ( cur->r - hashed.r == 0 &&
-         cur->g - hashed.g == 0 &&
-         cur->b - hashed.b == 0 &&
-         cur->a - hashed.a == 0 ) {
-            return (QoifChunk) {
-                .type = 2,
-                .pixelsCovered = 1,
-                .INDEX = (ChunkINDEX) {
-                    .index = hashedIndex,
-                }
-            };
-    }
-    if ( -2 <= dr   &&   dr <= 1 &&
-         -2 <= dg   &&   dg <= 1 &&
-         -2 <= db   &&   db <= 1 &&
-         da == 0) {
-            return (QoifChunk) {
-                .type = 3,
-                .pixelsCovered = 1,
-                .DIFF = (ChunkDIFF) {
-                    .dr=dr, .dg=dg, .db=db
-                }
-            };
-         }
-    if ( -32 <= dg     &&   dg <= 31 &&
-         -8 <= dr-dg   &&   dr-dg <= 7 &&
-         -8 <= db-dg   &&   db-dg <= 7 &&
-         da == 0) {
-            return (QoifChunk) {
-                .type = 4,
-                .pixelsCovered = 1,
-                .LUMA = (ChunkLUMA) {
-                    .dg=dg, .drdg=dr-dg, .dbdg=db-dg
-                }
-            };
-         }
-    if (raw.channels==4 && da!=0) {
-        return (QoifChunk) {
-                .type = 1,
-                .pixelsCovered = 1,
-                .RGBA = (ChunkRGBA) {
-                    .r=cur->r,
-                    .g=cur->g,
-                    .b=cur->b,
-                    .a=cur->a
-                }
-            };
-    }
-    return (QoifChunk) {
-                .type = 0,
-                .pixelsCovered = 1,
-                .RGB = (ChunkRGB) {
-                    .r=cur->r,
-                    .g=cur->g,
-                    .b=cur->b,
-                }
-            };
-}
-
+// Mip pyramid (encode --mips N): a single PNG decode feeds the full image and up to N
+// 2x2 box-filtered levels, each into its own QOI stream. outprefix_0.qoi is the full
+// image and outprefix_k.qoi is 1/2^k of it, with odd edges dropped. Rows cascade down
+// the levels as they are read, so each level only holds the row waiting for its partner.
 
-void writeBody( QoifImage *qoif, RawImage raw ) {
-    PixelRGBA palette[64] = {0};
-    PixelRGBA* currentPixel;
-    
-    while( raw.pixelsProcessed < raw.totalLengthInPixels ) {
+typedef struct {
+    StreamEncoder enc;
+    int width;
+    int height;
+    int parentWidth;
+    int parentHeight;
+    int rowsReceived;
+    PixelRGBA* pending; // even row of the level above, waiting for the odd one
+    PixelRGBA* row;
+} MipLevel;
+
+PixelRGBA averagePixels(PixelRGBA a, PixelRGBA b, PixelRGBA c, PixelRGBA d) {
+    return (PixelRGBA) {
+        (a.r + b.r + c.r + d.r + 2) >> 2,
+        (a.g + b.g + c.g + d.g + 2) >> 2,
+        (a.b + b.b + c.b + d.b + 2) >> 2,
+        (a.a + b.a + c.a + d.a + 2) >> 2
+    };
+}
 
-        currentPixel = ((PixelRGBA*) raw.data) + raw.pixelsProcessed;
+// Takes one row of the level above and passes the filtered rows further down
+void pushMipRow(MipLevel* levels, int count, int level, PixelRGBA* parentRow) {
+    MipLevel* m = &levels[level];
+    int index = m->rowsReceived++;
+    PixelRGBA* top = parentRow; // a single row pairs with itself
+    if (m->parentHeight > 1) {
+        if (index/2 >= m->height) return;
+        if (index % 2 == 0) {
+            memcpy(m->pending, parentRow, m->parentWidth * sizeof(PixelRGBA));
+            return;
+        }
+        top = m->pending;
+    }
 
-        QoifChunk chunk = decideNextChunk(raw, palette);
-        if (chunk.type==0) writeChunkRGB(qoif, chunk);
-        else if (chunk.type==1) writeChunkRGBA(qoif, chunk);
-        else if (chunk.type==2) writeChunkINDEX(qoif, chunk);
-        else if (chunk.type==3) writeChunkDIFF(qoif, chunk);
-        else if (chunk.type==4) writeChunkLUMA(qoif, chunk);
-        else if (chunk.type==5) writeChunkRUN(qoif, chunk);
-        addToPalette(*currentPixel, palette);
-        raw.pixelsProcessed += chunk.pixelsCovered;
+    for (int x = 0; x < m->width; x++) {
+        int x0 = 2*x;
+        int x1 = x0+1 < m->parentWidth ? x0+1 : x0;
+        m->row[x] = averagePixels(top[x0], top[x1], parentRow[x0], parentRow[x1]);
+        encodePixel(&m->enc, m->row[x]);
     }
+    if (level+1 < count) pushMipRow(levels, count, level+1, m->row);
 }
 
-
-void readPngFile(const char* filename, RawImage *image) {
-    FILE* fp = fopen(filename, "rb");
+int encodeMips(const char* input, const char* prefix, int count) {
+    FILE* fp = fopen(input, "rb");
     if (!fp) {
-        err = OpenFileError;
-        return;
+        printf("%s: %s\n", input, errorMessages[OpenFileError]);
+        return 1;
     }
-
-    // Create and initialize png_struct
     png_structp png = png_create_read_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
-    if (!png) {
-        fclose(fp);
-        err = PngError;
-        return;
-    }
-
-    // Create and initialize png_info
-    png_infop info = png_create_info_struct(png);
+    png_infop info = png ? png_create_info_struct(png) : NULL;
     if (!info) {
         png_destroy_read_struct(&png, NULL, NULL);
         fclose(fp);
-        err = PngError;
-        return;
+        printf("%s: %s\n", input, errorMessages[PngError]);
+        return 1;
     }
 
+    // everything below lives in one block so a libpng error has a single thing to free
+    unsigned char* volatile arena = NULL;
+    volatile int started = 0;
+    MipLevel* levels;
     if (setjmp(png_jmpbuf(png))) {
+        for (int i = 0; i < started; i++) free(((MipLevel*) arena)[i].enc.out.data);
+        free(arena);
         png_destroy_read_struct(&png, &info, NULL);
         fclose(fp);
-        err = PngError;
-        return;
+        printf("%s: %s\n", input, errorMessages[PngError]);
+        return 1;
     }
 
     png_init_io(png, fp);
     png_read_info(png, info);
-
-    // Get image info
+    expandToRGBA(png, info);
+    int interlaced = png_set_interlace_handling(png) > 1;
+    png_read_update_info(png, info);
     int width = png_get_image_width(png, info);
     int height = png_get_image_height(png, info);
-    png_byte color_type = png_get_color_type(png, info);
-    png_byte bit_depth = png_get_bit_depth(png, info);
-
-    // Adjustments based on color type
-    if (bit_depth == 16) {
-        png_set_strip_16(png);  // Reduce 16-bit images to 8-bit
-    }
-    if (color_type == PNG_COLOR_TYPE_PALETTE) {
-        png_set_palette_to_rgb(png);  // Convert palette to RGB
+    int channels = png_get_channels(png, info);
+    int colorspace = pngColorspace(png, info);
+
+    // level sizes, stopping early once a level is down to a single pixel
+    int levelCount = 1;
+    int w = width, h = height;
+    while (levelCount <= count && (w > 1 || h > 1)) {
+        w = w > 1 ? w/2 : 1;
+        h = h > 1 ? h/2 : 1;
+        levelCount++;
     }
-    if (color_type == PNG_COLOR_TYPE_GRAY && bit_depth < 8) {
-        png_set_expand_gray_1_2_4_to_8(png);  // Expand grayscale
+    long rowBytes = (long) width * sizeof(PixelRGBA);
+    long size = levelCount * sizeof(MipLevel) + (interlaced ? rowBytes * height : rowBytes) + 2 * levelCount * rowBytes;
+    arena = malloc(size);
+    if (!arena) longjmp(png_jmpbuf(png), 1);
+    levels = (MipLevel*) arena;
+    PixelRGBA* image = (PixelRGBA*) (arena + levelCount * sizeof(MipLevel));
+    PixelRGBA* rows = image + (interlaced ? (long) width * height : width);
+
+    for (int i = 0; i < levelCount; i++) {
+        MipLevel* m = &levels[i];
+        m->parentWidth = i ? levels[i-1].width : width;
+        m->parentHeight = i ? levels[i-1].height : height;
+        m->width = i == 0 ? width : m->parentWidth > 1 ? m->parentWidth/2 : 1;
+        m->height = i == 0 ? height : m->parentHeight > 1 ? m->parentHeight/2 : 1;
+        m->rowsReceived = 0;
+        m->pending = rows + 2L*i*width;
+        m->row = m->pending + width;
+        startStreamEncoder(&m->enc, m->width, m->height, channels, colorspace);
+        if (err != NoError) longjmp(png_jmpbuf(png), 1);
+        started++;
     }
-    if (png_get_valid(png, info, PNG_INFO_tRNS)) {
-        png_set_tRNS_to_alpha(png);  // Add alpha if transparency info is present
+
+    // an interlaced PNG only has final rows after its last pass, so it is read whole
+    if (interlaced) {
+        png_bytep rowPointers[height];
+        for (int y = 0; y < height; y++) rowPointers[y] = (png_bytep) (image + (long) y*width);
+        png_read_image(png, rowPointers);
     }
-    if (color_type == PNG_COLOR_TYPE_RGB || color_type == PNG_COLOR_TYPE_GRAY || color_type == PNG_COLOR_TYPE_PALETTE) {
-        png_set_filler(png, 0xFF, PNG_FILLER_AFTER);  // Add alpha channel if needed
+    for (int y = 0; y < height; y++) {
+        PixelRGBA* row = interlaced ? image + (long) y*width : image;
+        if (!interlaced) png_read_row(png, (png_bytep) row, NULL);
+        for (int x = 0; x < width; x++) encodePixel(&levels[0].enc, row[x]);
+        if (levelCount > 1) pushMipRow(levels, levelCount, 1, row);
     }
+    png_read_end(png, NULL);
+    png_destroy_read_struct(&png, &info, NULL);
+    fclose(fp);
 
-    png_read_update_info(png, info);
+    int failed = 0;
+    char filename[4096];
+    for (int i = 0; i < levelCount; i++) {
+        finishStreamEncoder(&levels[i].enc);
+        snprintf(filename, sizeof(filename), "%s_%d.qoi", prefix, i);
+        saveToFile(levels[i].enc.out, filename);
+        if (err != NoError) {
+            printf("%s: %s\n", filename, errorMessages[err]);
+            failed = 1;
+        }
+        free(levels[i].enc.out.data);
+    }
+    free(arena);
+    return failed;
+}
 
-    int channels = png_get_channels(png, info);  // Get the number of channels
+// Progressive container (encode --progressive, "qprg"): the image split into its seven
+// Adam7 passes, coarsest first, each a complete QOI stream with its own state, so a
+// reader can show the first pass, 1/64 of the pixels, after a small part of the file.
+//   header   magic "qprg", width, height (BE), channels, colorspace
+//   passes   seven times: length (BE), then a .qoi stream of the pass's pixels
 
-    // Allocate memory for image data
-    unsigned char* data = (unsigned char*)malloc(width * height * channels);
-    if (!data) {
-        png_destroy_read_struct(&png, &info, NULL);
-        fclose(fp);
-        err = MemAllocError;
-        return;
+int encodeProgressive(const char* input, const char* output) {
+    RawImage raw;
+    readPngFile(input, &raw);
+    if (err != NoError) {
+        printf("%s: %s\n", input, errorMessages[err]);
+        return 1;
     }
-
-    png_bytep* row_pointers = (png_bytep*)malloc(sizeof(png_bytep) * height);
-    for (int y = 0; y < height; y++) {
-        row_pointers[y] = data + y * width * channels;
+    FILE* file = fopen(output, "wb");
+    if (!file) {
+        printf("%s: %s\n", output, errorMessages[OpenFileError]);
+        free(raw.data);
+        return 1;
     }
 
-    // Read the image
-    png_read_image(png, row_pointers);
+    unsigned char header[14];
+    memcpy(header, "qprg", 4);
+    putBE32(header + 4, raw.width);
+    putBE32(header + 8, raw.height);
+    header[12] = raw.channels;
+    header[13] = raw.colorspace;
+    int failed = fwrite(header, 1, 14, file) != 14;
+
+    for (int p = 0; p < 7 && !failed; p++) {
+        QoifImage qoif;
+        encodePass(raw, p, &qoif);
+        if (err != NoError) {
+            failed = 1;
+            break;
+        }
 
-    // Cleanup
-    fclose(fp);
-    png_destroy_read_struct(&png, &info, NULL);
-    free(row_pointers);
-
-    // Store image data
-    image->data = data;
-    image->width = width;
-    image->height = height;
-    image->channels = channels;
-    image->pixelsProcessed = 0;
-    image->totalLengthInPixels = width*height;
-    err = NoError;
+        unsigned char length[4];
+        putBE32(length, qoif.bytesAdded);
+        failed = fwrite(length, 1, 4, file) != 4 || fwrite(qoif.data, 1, qoif.bytesAdded, file) != (size_t) qoif.bytesAdded;
+        if (failed) err = WriteFileError;
+        free(qoif.data);
+    }
+    free(raw.data);
+    if (fclose(file) != 0 && !failed) {
+        err = WriteFileError;
+        failed = 1;
+    }
+    if (failed) {
+        printf("%s: %s\n", output, errorMessages[err]);
+        unlink(output);
+        return 1;
+    }
+    return 0;
 }
 
-void saveToFile( QoifImage qoif, char* filename ) {
-    FILE* file = fopen(filename, "wb");
-    if (!file) {
-        err = OpenFileError;
-        return;
+
+// Batch encoder (encode --batch) for piles of tiny images such as icons and tiles, where
+// one encode is over before the core gets going. Images are read a batch at a time and
+// all their streams go into one arena that is kept between batches, see encodeBatch.
+// Pixel buffers are kept per slot too. libpng can't reset its read and write structs, so
+// those are still made for every file.
+#define BATCH_IMAGES 256
+
+// encode --batch: returns the process exit code
+int encodeBatchFiles( FileList *files, const char* outdir ) {
+    RawImage images[BATCH_IMAGES];
+    QoifImage outputs[BATCH_IMAGES];
+    long offsets[BATCH_IMAGES + 1];
+    long source[BATCH_IMAGES];
+    unsigned char* pixelBuffers[BATCH_IMAGES] = {0};
+    long pixelCapacity[BATCH_IMAGES] = {0};
+    unsigned char* arena = NULL;
+    long arenaSize = 0;
+    long converted = 0, failed = 0, pixels = 0;
+    double encodeSeconds = 0;
+
+    if (files->count == 0) {
+        printf("No files to convert\n");
+        return 0;
     }
-    size_t written = fwrite(qoif.data, 1, qoif.bytesAdded, file);
-    if (written != qoif.bytesAdded) {
-        err = WriteFileError;
-        fclose(file);
-        return;
+    if (countNameClashes(files)) return 1;
+
+    struct timespec start, step;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    for (long first = 0; first < files->count; first += BATCH_IMAGES) {
+        int count = 0;
+        offsets[0] = 0;
+        for (long f = first; f < files->count && f < first + BATCH_IMAGES; f++) {
+            readPngFileInto(files->names[f], &images[count], &pixelBuffers[count], &pixelCapacity[count]);
+            if (err != NoError) {
+                printf("%s: %s\n", files->names[f], errorMessages[err]);
+                failed++;
+                continue;
+            }
+            source[count] = f;
+            offsets[count+1] = offsets[count] + qoifBound(images[count]);
+            pixels += images[count].totalLengthInPixels;
+            count++;
+        }
+
+        if (offsets[count] > arenaSize) {
+            free(arena);
+            arenaSize = offsets[count] * 2;
+            arena = malloc(arenaSize);
+            if (!arena) {
+                printf("%s\n", errorMessages[MemAllocError]);
+                for (int i = 0; i < BATCH_IMAGES; i++) free(pixelBuffers[i]);
+                return 1;
+            }
+        }
+
+        clock_gettime(CLOCK_MONOTONIC, &step);
+        encodeBatch(images, count, arena, offsets, outputs);
+        encodeSeconds += secondsSince(step);
+
+        for (int i = 0; i < count; i++) {
+            char name[4096], path[8192];
+            spriteName(files->names[source[i]], name, sizeof(name));
+            snprintf(path, sizeof(path), "%s/%s.qoi", outdir, name);
+            saveToFile(outputs[i], path);
+            if (err != NoError) {
+                printf("%s: %s\n", path, errorMessages[err]);
+                failed++;
+            }
+            else converted++;
+        }
     }
-    fclose(file);
-    err = NoError;
-    return;
+    free(arena);
+    for (int i = 0; i < BATCH_IMAGES; i++) free(pixelBuffers[i]);
+
+    double seconds = secondsSince(start);
+    printf("%ld images converted, %ld failed in %.3f s: %.1f images/s; encoding alone %.3f s, %.1f images/s, %.1f MP/s\n",
+        converted, failed, seconds, converted / seconds,
+        encodeSeconds, converted / encodeSeconds, pixels / 1e6 / encodeSeconds);
+    return failed ? 1 : 0;
 }
 
 
+int printUsage() {
+    puts("Usage: encode [--stats[=json]] [-j threads] [--near maxerror] [--lz] [--analytics]");
+    puts("              [--colorspace srgb|linear] filename.png outputname.qoi");
+    puts("       encode --pack outputname.qpak filename.png|directory ...");
+    puts("       encode --bulk [-j threads] [--queue-depth n] [--io=uring|sync] outputdir filename.png|directory ...");
+    puts("       encode --watch [-j threads] spooldir outputdir");
+    puts("       encode --sequence outputname.qseq frame.png ...");
+    puts("       encode --mips levels filename.png outputprefix");
+    puts("       encode --progressive filename.png outputname.qprg");
+    puts("       encode --batch outputdir filename.png|directory ...");
+    return 1;
+}
+
 int main(int argc, char** argv) {
 
-    if (argc != 3) {
-        puts("Usage: encode filename.png outputname.qoi");
-        return 1;
+    char* files[argc];
+    int fileCount = 0;
+    int statsFormat = 0; // 0 = off, 1 = text, 2 = JSON
+    Stats collected = {0};
+    int pack = 0;
+    int bulk = 0;
+    int watch = 0;
+    int sequence = 0;
+    int tolerance = 0;
+    int lz = 0;
+    int mips = 0;
+    int progressive = 0;
+    int batch = 0;
+    Analytics gathered;
+    int analyze = 0;
+    int badColorspace = 0;
+    int threads = sysconf(_SC_NPROCESSORS_ONLN);
+    BulkJob job = { .extension = ".qoi", .convert = convertBuffer, .queueDepth = 16, .bufferSize = 1<<20, .useUring = 1 };
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--stats") == 0) statsFormat = 1;
+        else if (strcmp(argv[i], "--stats=json") == 0) statsFormat = 2;
+        else if (strcmp(argv[i], "--pack") == 0) pack = 1;
+        else if (strcmp(argv[i], "--bulk") == 0) bulk = 1;
+        else if (strcmp(argv[i], "--watch") == 0) watch = 1;
+        else if (strcmp(argv[i], "--sequence") == 0) sequence = 1;
+        else if (strcmp(argv[i], "--lz") == 0) lz = 1;
+        else if (strcmp(argv[i], "--progressive") == 0) progressive = 1;
+        else if (strcmp(argv[i], "--batch") == 0) batch = 1;
+        else if (strcmp(argv[i], "--analytics") == 0) analyze = 1;
+        else if (strcmp(argv[i], "--colorspace") == 0 && i+1 < argc) {
+            i++;
+            if (strcmp(argv[i], "linear") == 0) colorspaceOverride = 1;
+            else if (strcmp(argv[i], "srgb") == 0) colorspaceOverride = 0;
+            else badColorspace = 1;
+        }
+        else if (strcmp(argv[i], "--mips") == 0 && i+1 < argc) mips = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--near") == 0 && i+1 < argc) tolerance = atoi(argv[++i]);
+        else if (strcmp(argv[i], "-j") == 0 && i+1 < argc) threads = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--queue-depth") == 0 && i+1 < argc) job.queueDepth = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--io=sync") == 0) job.useUring = 0;
+        else if (strcmp(argv[i], "--io=uring") == 0) job.useUring = 1;
+        else files[fileCount++] = argv[i];
+    }
+
+    // --stats, --near, --lz and --analytics only apply to a single file
+    int singleFileOptions = statsFormat || tolerance || lz || analyze;
+    int otherMode = pack || bulk || watch || sequence || mips || progressive || batch;
+    if (badColorspace || (singleFileOptions && otherMode)) return printUsage();
+
+    if (pack && fileCount >= 2) {
+        FileList inputs = {0};
+        for (int i = 1; i < fileCount; i++) collectFiles(files[i], ".png", &inputs);
+        return packPngFiles(&inputs, files[0]);
+    }
+    if (bulk && fileCount >= 2) {
+        FileList inputs = {0};
+        for (int i = 1; i < fileCount; i++) collectFiles(files[i], ".png", &inputs);
+        job.files = &inputs;
+        job.outdir = files[0];
+        return convertFiles(&job, threads);
+    }
+    if (watch && fileCount == 2) {
+        WatchJob watching = { files[0], files[1], ".png", ".qoi", convertSpooledPng };
+        return watchDirectory(&watching, threads);
+    }
+    if (sequence && fileCount >= 2) {
+        return encodeSequence(files+1, fileCount-1, files[0]);
+    }
+    if (mips > 0 && fileCount == 2) {
+        return encodeMips(files[0], files[1], mips);
+    }
+    if (progressive && fileCount == 2) {
+        return encodeProgressive(files[0], files[1]);
     }
+    if (batch && fileCount >= 2) {
+        FileList inputs = {0};
+        for (int i = 1; i < fileCount; i++) collectFiles(files[i], ".png", &inputs);
+        return encodeBatchFiles(&inputs, files[0]);
+    }
+    if (otherMode || fileCount != 2) return printUsage();
+    if (statsFormat) stats = &collected;
+
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
 
     RawImage raw;
-    readPngFile(argv[1], &raw);
+    readPngFile(files[0], &raw);
     
     if (err != NoError) {
         printf("%s\n", errorMessages[err]);
         return 1;
     }
+    if (stats) {
+        stats->seconds[0] = secondsSince(start);
+        clock_gettime(CLOCK_MONOTONIC, &start);
+    }
 
+    if (analyze) {
+        startAnalytics(&gathered, raw.width, raw.height);
+        analytics = &gathered;
+    }
 
     QoifImage qoif;
     createQoifBuffer(raw, &qoif);
-    writeHeader(&qoif, raw.width, raw.height, raw.channels==4);
-    writeBody(&qoif, raw);
+    writeHeader(&qoif, raw.width, raw.height, raw.channels==4, raw.colorspace);
+    if (tolerance > 0) writeBodyNearLossless(&qoif, raw, tolerance);
+    else if (stats || analytics) writeBody(&qoif, raw); // the counters aren't shared between threads
+    else writeBodyParallel(&qoif, raw, threads);
     writeFooter(&qoif);
-    saveToFile(qoif, argv[2]);
+    if (lz) compressQoif(&qoif);
+    if (err != NoError) {
+        printf("%s\n", errorMessages[err]);
+        return 1;
+    }
+    if (stats) {
+        stats->seconds[1] = secondsSince(start);
+        clock_gettime(CLOCK_MONOTONIC, &start);
+    }
+
+    saveToFile(qoif, files[1]);
+    if (analytics && err == NoError) saveAnalytics(analytics, files[1]);
 
     if (err != NoError) {
         printf("%s\n", errorMessages[err]);
         return 1;
     }
+    if (stats) {
+        stats->seconds[2] = secondsSince(start);
+        printStats(stats, statsFormat==2, raw.totalLengthInPixels, qoif.bytesAdded, "encode");
+    }
     return 0;
 }
 
@@ -0,0 +1,423 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include "qoi.h"
+#include "ioRing.h"
+
+
+void closeIoRing(IoRing *ring) {
+    munmap(ring->sqes, ring->sqesSize);
+    if (ring->cqRing != ring->sqRing) munmap(ring->cqRing, ring->cqRingSize);
+    munmap(ring->sqRing, ring->sqRingSize);
+    close(ring->fd);
+}
+
+// 0 on success, -1 if the kernel doesn't give us a ring
+int openIoRing(IoRing *ring, unsigned entries) {
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    memset(ring, 0, sizeof(*ring));
+    ring->fd = syscall(__NR_io_uring_setup, entries, &params);
+    if (ring->fd < 0) return -1;
+
+    ring->sqRingSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    ring->cqRingSize = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    ring->sqesSize = params.sq_entries * sizeof(struct io_uring_sqe);
+    int singleMap = params.features & IORING_FEAT_SINGLE_MMAP;
+    if (singleMap) {
+        if (ring->cqRingSize > ring->sqRingSize) ring->sqRingSize = ring->cqRingSize;
+        ring->cqRingSize = ring->sqRingSize;
+    }
+
+    ring->sqRing = mmap(NULL, ring->sqRingSize, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+    if (ring->sqRing == MAP_FAILED) {
+        close(ring->fd);
+        return -1;
+    }
+    ring->cqRing = singleMap ? ring->sqRing :
+        mmap(NULL, ring->cqRingSize, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+    ring->sqes = mmap(NULL, ring->sqesSize, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+    if (ring->cqRing == MAP_FAILED || ring->sqes == MAP_FAILED) {
+        if (ring->cqRing != MAP_FAILED && ring->cqRing != ring->sqRing) munmap(ring->cqRing, ring->cqRingSize);
+        munmap(ring->sqRing, ring->sqRingSize);
+        close(ring->fd);
+        return -1;
+    }
+
+    unsigned char* sq = ring->sqRing;
+    unsigned char* cq = ring->cqRing;
+    ring->sqHead = (unsigned*) (sq + params.sq_off.head);
+    ring->sqTail = (unsigned*) (sq + params.sq_off.tail);
+    ring->sqMask = (unsigned*) (sq + params.sq_off.ring_mask);
+    ring->sqArray = (unsigned*) (sq + params.sq_off.array);
+    ring->cqHead = (unsigned*) (cq + params.cq_off.head);
+    ring->cqTail = (unsigned*) (cq + params.cq_off.tail);
+    ring->cqMask = (unsigned*) (cq + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe*) (cq + params.cq_off.cqes);
+    ring->entries = params.sq_entries;
+    return 0;
+}
+
+void registerIoBuffers(IoRing *ring, unsigned char* arena, unsigned count, long size) {
+    struct iovec iov[count];
+    for (unsigned i = 0; i<count; i++) {
+        iov[i].iov_base = arena + i*size;
+        iov[i].iov_len = size;
+    }
+    ring->fixedBuffers = syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_BUFFERS, iov, count) == 0;
+}
+
+// The SQ never overflows: at most one request per slot is in flight and slots <= entries
+void queueIo(IoRing *ring, int opcode, int fd, void* addr, unsigned length, long offset, int bufferIndex, uint64_t userData) {
+    unsigned tail = *ring->sqTail;
+    unsigned index = tail & *ring->sqMask;
+    struct io_uring_sqe* sqe = &ring->sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = opcode;
+    sqe->fd = fd;
+    sqe->addr = (uint64_t) (uintptr_t) addr;
+    sqe->len = length;
+    sqe->off = offset;
+    sqe->buf_index = bufferIndex;
+    sqe->user_data = userData;
+    ring->sqArray[index] = index;
+    __atomic_store_n(ring->sqTail, tail+1, __ATOMIC_RELEASE);
+    ring->queued++;
+}
+
+// 0 on success, -1 with errno set once the kernel refuses the ring
+int submitAndWait(IoRing *ring, unsigned waitFor) {
+    while (1) {
+        int submitted = syscall(__NR_io_uring_enter, ring->fd, ring->queued, waitFor, IORING_ENTER_GETEVENTS, NULL, 0);
+        if (submitted >= 0) {
+            ring->queued -= submitted;
+            return 0;
+        }
+        if (errno != EINTR && errno != EAGAIN) return -1;
+    }
+}
+
+int reapCompletion(IoRing *ring, uint64_t *userData, int *result) {
+    unsigned head = *ring->cqHead;
+    if (head == __atomic_load_n(ring->cqTail, __ATOMIC_ACQUIRE)) return 0;
+    struct io_uring_cqe* cqe = &ring->cqes[head & *ring->cqMask];
+    *userData = cqe->user_data;
+    *result = cqe->res;
+    __atomic_store_n(ring->cqHead, head+1, __ATOMIC_RELEASE);
+    return 1;
+}
+
+
+// Bulk conversion (encode --bulk, decode --bulk). Every worker thread owns an io_uring
+// and keeps up to queueDepth files in flight: reads land in buffers registered with the
+// ring and are converted from there, and each output is written as soon as it is ready.
+// Without io_uring, or once the ring fails, the workers use pread/pwrite.
+
+typedef struct {
+    int state;           // 0 = free, 1 = reading, 2 = writing
+    int fd;
+    long file;
+    unsigned char* fixed; // this slot's registered buffer
+    unsigned char* in;    // fixed, or malloc'd for big files
+    long inLength;
+    long done;            // bytes transferred so far
+    unsigned char* out;
+    long outLength;
+} BulkSlot;
+
+void bulkFailed(BulkJob *job, long file, const char* message) {
+    printf("%s: %s\n", job->files->names[file], message);
+    __atomic_fetch_add(&job->failed, 1, __ATOMIC_RELAXED);
+}
+
+void bulkOutputName(BulkJob *job, long file, char* path, size_t size) {
+    char name[4096];
+    spriteName(job->files->names[file], name, sizeof(name));
+    snprintf(path, size, "%s/%s%s", job->outdir, name, job->extension);
+}
+
+// Writes and counts one output; a partial one is removed again
+void writeOutputSync(BulkJob *job, long file, unsigned char* data, long length, long inLength) {
+    char path[8192];
+    bulkOutputName(job, file, path, sizeof(path));
+    int fd = open(path, O_WRONLY|O_CREAT|O_TRUNC, 0644);
+    if (fd < 0) {
+        bulkFailed(job, file, errorMessages[OpenFileError]);
+        return;
+    }
+    long done = writeWhole(fd, data, length);
+    close(fd);
+    if (done < length) {
+        unlink(path);
+        bulkFailed(job, file, errorMessages[WriteFileError]);
+        return;
+    }
+    __atomic_fetch_add(&job->converted, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&job->bytesIn, inLength, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&job->bytesOut, length, __ATOMIC_RELAXED);
+}
+
+void bulkWorkerSync(BulkJob *job) {
+    unsigned char* buffer = NULL; // kept warm across files
+    long capacity = 0;
+
+    while (1) {
+        long file = __atomic_fetch_add(&job->nextFile, 1, __ATOMIC_RELAXED);
+        if (file >= job->files->count) break;
+
+        int fd = open(job->files->names[file], O_RDONLY);
+        struct stat st;
+        if (fd < 0 || fstat(fd, &st) != 0) {
+            if (fd >= 0) close(fd);
+            bulkFailed(job, file, errorMessages[OpenFileError]);
+            continue;
+        }
+        if (st.st_size > capacity) {
+            free(buffer);
+            capacity = st.st_size;
+            buffer = malloc(capacity);
+            if (!buffer) {
+                capacity = 0;
+                close(fd);
+                bulkFailed(job, file, errorMessages[MemAllocError]);
+                continue;
+            }
+        }
+        long done = readWhole(fd, buffer, st.st_size);
+        close(fd);
+        if (done < st.st_size) {
+            bulkFailed(job, file, errorMessages[ReadFileError]);
+            continue;
+        }
+
+        unsigned char* out;
+        long outLength;
+        job->convert(buffer, st.st_size, &out, &outLength);
+        if (err != NoError) {
+            bulkFailed(job, file, errorMessages[err]);
+            continue;
+        }
+        writeOutputSync(job, file, out, outLength, st.st_size);
+        free(out);
+    }
+    free(buffer);
+}
+
+void queueTransfer(IoRing *ring, BulkSlot *slot, unsigned index) {
+    if (slot->state == 2) {
+        queueIo(ring, IORING_OP_WRITE, slot->fd, slot->out + slot->done,
+            slot->outLength - slot->done, slot->done, 0, index);
+    }
+    else if (slot->in == slot->fixed && ring->fixedBuffers) {
+        queueIo(ring, IORING_OP_READ_FIXED, slot->fd, slot->in + slot->done,
+            slot->inLength - slot->done, slot->done, index, index);
+    }
+    else {
+        queueIo(ring, IORING_OP_READ, slot->fd, slot->in + slot->done,
+            slot->inLength - slot->done, slot->done, 0, index);
+    }
+}
+
+// Opens the next file and queues its read. 0 once there are no files left.
+int startRead(BulkJob *job, IoRing *ring, BulkSlot *slot, unsigned index) {
+    while (1) {
+        long file = __atomic_fetch_add(&job->nextFile, 1, __ATOMIC_RELAXED);
+        if (file >= job->files->count) return 0;
+
+        int fd = open(job->files->names[file], O_RDONLY);
+        struct stat st;
+        if (fd < 0 || fstat(fd, &st) != 0) {
+            if (fd >= 0) close(fd);
+            bulkFailed(job, file, errorMessages[OpenFileError]);
+            continue;
+        }
+        slot->in = st.st_size <= job->bufferSize ? slot->fixed : malloc(st.st_size);
+        if (!slot->in) {
+            close(fd);
+            bulkFailed(job, file, errorMessages[MemAllocError]);
+            continue;
+        }
+        slot->fd = fd;
+        slot->file = file;
+        slot->inLength = st.st_size;
+        slot->done = 0;
+        slot->state = 1;
+        queueTransfer(ring, slot, index);
+        return 1;
+    }
+}
+
+void finishSlot(BulkSlot *slot) {
+    if (slot->in != slot->fixed) free(slot->in);
+    if (slot->state == 2) free(slot->out);
+    slot->in = NULL;
+    slot->state = 0;
+}
+
+void completeTransfer(BulkJob *job, IoRing *ring, BulkSlot *slot, unsigned index, int result) {
+    long total = slot->state == 1 ? slot->inLength : slot->outLength;
+    if (result < 0 || (result == 0 && slot->done < total)) {
+        close(slot->fd);
+        if (slot->state == 2) {
+            char path[8192];
+            bulkOutputName(job, slot->file, path, sizeof(path));
+            unlink(path);
+        }
+        bulkFailed(job, slot->file, result < 0 ? strerror(-result) : errorMessages[slot->state == 1 ? ReadFileError : WriteFileError]);
+        finishSlot(slot);
+        return;
+    }
+    slot->done += result;
+    if (slot->done < total) {
+        queueTransfer(ring, slot, index); // short read or write
+        return;
+    }
+    close(slot->fd);
+
+    if (slot->state == 2) {
+        __atomic_fetch_add(&job->converted, 1, __ATOMIC_RELAXED);
+        __atomic_fetch_add(&job->bytesIn, slot->inLength, __ATOMIC_RELAXED);
+        __atomic_fetch_add(&job->bytesOut, slot->outLength, __ATOMIC_RELAXED);
+        finishSlot(slot);
+        return;
+    }
+
+    job->convert(slot->in, slot->inLength, &slot->out, &slot->outLength);
+    if (err != NoError) {
+        bulkFailed(job, slot->file, errorMessages[err]);
+        finishSlot(slot);
+        return;
+    }
+    char path[8192];
+    bulkOutputName(job, slot->file, path, sizeof(path));
+    slot->fd = open(path, O_WRONLY|O_CREAT|O_TRUNC, 0644);
+    slot->state = 2;
+    if (slot->fd < 0) {
+        bulkFailed(job, slot->file, errorMessages[OpenFileError]);
+        finishSlot(slot);
+        return;
+    }
+    slot->done = 0;
+    queueTransfer(ring, slot, index);
+}
+
+// Once the ring fails, a slot in flight starts its transfer over with pread/pwrite
+void finishSlotSync(BulkJob *job, BulkSlot *slot) {
+    if (slot->state == 1) {
+        long done = readWhole(slot->fd, slot->in, slot->inLength);
+        close(slot->fd);
+        if (done < slot->inLength) {
+            bulkFailed(job, slot->file, errorMessages[ReadFileError]);
+            finishSlot(slot);
+            return;
+        }
+        job->convert(slot->in, slot->inLength, &slot->out, &slot->outLength);
+        if (err != NoError) {
+            bulkFailed(job, slot->file, errorMessages[err]);
+            finishSlot(slot);
+            return;
+        }
+        slot->state = 2;
+    }
+    else {
+        close(slot->fd);
+    }
+    writeOutputSync(job, slot->file, slot->out, slot->outLength, slot->inLength);
+    finishSlot(slot);
+}
+
+void* bulkWorker(void* arg) {
+    BulkJob* job = arg;
+    IoRing ring;
+    if (!job->useUring || openIoRing(&ring, job->queueDepth) != 0) {
+        bulkWorkerSync(job);
+        return NULL;
+    }
+
+    unsigned depth = job->queueDepth < ring.entries ? job->queueDepth : ring.entries;
+    BulkSlot* slots = calloc(depth, sizeof(BulkSlot));
+    unsigned char* arena = NULL;
+    if (!slots || posix_memalign((void**) &arena, 4096, depth * job->bufferSize) != 0) {
+        free(slots);
+        closeIoRing(&ring);
+        bulkWorkerSync(job);
+        return NULL;
+    }
+    for (unsigned i = 0; i<depth; i++) slots[i].fixed = arena + i*job->bufferSize;
+    registerIoBuffers(&ring, arena, depth, job->bufferSize);
+    int backend = ring.fixedBuffers ? 2 : 1;
+    if (__atomic_load_n(&job->backend, __ATOMIC_RELAXED) < backend) __atomic_store_n(&job->backend, backend, __ATOMIC_RELAXED);
+
+    int filesLeft = 1;
+    int failed = 0;
+    while (1) {
+        unsigned busy = 0;
+        for (unsigned i = 0; i<depth; i++) {
+            if (slots[i].state == 0 && filesLeft) filesLeft = startRead(job, &ring, &slots[i], i);
+            if (slots[i].state != 0) busy++;
+        }
+        if (busy == 0) break;
+
+        if (submitAndWait(&ring, 1) != 0) {
+            printf("io_uring: %s, going on with pread/pwrite\n", strerror(errno));
+            for (unsigned i = 0; i<depth; i++) {
+                if (slots[i].state != 0) finishSlotSync(job, &slots[i]);
+            }
+            failed = 1;
+            break;
+        }
+        uint64_t index;
+        int result;
+        while (reapCompletion(&ring, &index, &result)) {
+            completeTransfer(job, &ring, &slots[index], index, result);
+        }
+    }
+
+    closeIoRing(&ring);
+    free(arena);
+    free(slots);
+    if (failed) bulkWorkerSync(job);
+    return NULL;
+}
+
+// encode --bulk and decode --bulk: returns the process exit code
+int convertFiles(BulkJob *job, int threads) {
+    if (job->files->count == 0) {
+        printf("No files to convert\n");
+        return 0;
+    }
+    if (threads < 1) threads = 1;
+    if (threads > job->files->count) threads = job->files->count;
+    if (job->queueDepth < 1) job->queueDepth = 1;
+    if (countNameClashes(job->files) != 0) return 1;
+
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    pthread_t workers[threads];
+    for (int i = 0; i < threads; i++) {
+        pthread_create(&workers[i], NULL, bulkWorker, job);
+    }
+    for (int i = 0; i < threads; i++) {
+        pthread_join(workers[i], NULL);
+    }
+
+    double seconds = secondsSince(start);
+    const char* backends[] = { "pread/pwrite", "io_uring", "io_uring, registered buffers" };
+    printf("%ld files converted, %ld failed in %.3f s: %.1f files/s, %.1f MB/s in, %.1f MB/s out (%s)\n",
+        job->converted, job->failed, seconds,
+        job->converted / seconds, job->bytesIn / 1e6 / seconds, job->bytesOut / 1e6 / seconds,
+        backends[job->backend]);
+    return job->failed ? 1 : 0;
+}
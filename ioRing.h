@@ -0,0 +1,55 @@
+// io_uring without liburing, and the bulk conversion engine of encode --bulk and
+// decode --bulk built on it. The decode --scan header scanner uses the ring alone.
+#ifndef IO_RING_H
+#define IO_RING_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <linux/io_uring.h>
+#include "qoi.h"
+
+
+typedef struct {
+    int fd;
+    unsigned *sqHead, *sqTail, *sqMask, *sqArray;
+    unsigned *cqHead, *cqTail, *cqMask;
+    struct io_uring_sqe* sqes;
+    struct io_uring_cqe* cqes;
+    unsigned entries;
+    unsigned queued;     // written to the SQ but not submitted yet
+    int fixedBuffers;    // 1 once IORING_REGISTER_BUFFERS succeeded
+    void* sqRing;
+    void* cqRing;
+    size_t sqRingSize, cqRingSize, sqesSize;
+} IoRing;
+
+void closeIoRing(IoRing *ring);
+int openIoRing(IoRing *ring, unsigned entries);
+void registerIoBuffers(IoRing *ring, unsigned char* arena, unsigned count, long size);
+void queueIo(IoRing *ring, int opcode, int fd, void* addr, unsigned length, long offset, int bufferIndex, uint64_t userData);
+int submitAndWait(IoRing *ring, unsigned waitFor);
+int reapCompletion(IoRing *ring, uint64_t *userData, int *result);
+
+
+// What the tool does to every file: turns the bytes read into a malloc'd output, or sets err
+typedef void (*BulkConvert)(unsigned char* in, long length, unsigned char** out, long* outLength);
+
+typedef struct {
+    FileList* files;
+    const char* outdir;
+    const char* extension; // of the outputs, with the dot
+    BulkConvert convert;
+    unsigned queueDepth;
+    long bufferSize;     // per slot, files that don't fit get their own allocation
+    int useUring;
+    long nextFile;       // shared work counter
+    long converted;
+    long failed;
+    long bytesIn;
+    long bytesOut;
+    int backend;         // best backend any worker got: 0 = pread/pwrite, 1 = io_uring, 2 = with registered buffers
+} BulkJob;
+
+int convertFiles(BulkJob *job, int threads);
+
+#endif
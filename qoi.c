@@ -0,0 +1,305 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <dirent.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+#include "qoi.h"
+
+
+_Thread_local enum Error err;
+
+char* errorMessages[] = {
+    "No errors",
+    "Can't open file",
+    "Can't read file",
+    "Can't allocate enough memory",
+    "Error related to libpng",
+    "Can't write file",
+    "Invalid QOI header",
+    "Truncated chunk",
+    "Chunks don't cover the image exactly",
+    "Missing or misplaced end marker",
+    "Corrupt compressed block",
+    "End marker before last pixel"
+};
+
+Stats* stats = NULL;
+Analytics* analytics = NULL;
+
+
+void countChunk(Stats *s, int type, int pixelsCovered) {
+    s->chunks[type]++;
+    if (type==5) s->runLengths[pixelsCovered]++;
+}
+
+// work names the middle stage, "encode" or "decode"
+void printStats(Stats *s, int json, long pixels, long fileBytes, const char* work) {
+    const char* chunkNames[] = { "RGB", "RGBA", "INDEX", "DIFF", "LUMA", "RUN" };
+    const int chunkSizes[] = { 4, 5, 1, 1, 2, 1 };
+    const char* stageNames[] = { "read", work, "write" };
+
+    long nonRunChunks = 0;
+    for (int i = 0; i<5; i++) nonRunChunks += s->chunks[i];
+    double hitRate = nonRunChunks ? (double) s->chunks[2] / nonRunChunks : 0;
+
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+
+    if (json) {
+        printf("{\"pixels\": %ld, \"bytes\": %ld, \"chunks\": {", pixels, fileBytes);
+        for (int i = 0; i<6; i++) {
+            printf("%s\"%s\": {\"count\": %ld, \"bytes\": %ld}", i ? ", " : "",
+                chunkNames[i], s->chunks[i], s->chunks[i]*chunkSizes[i]);
+        }
+        printf("}, \"paletteHitRate\": %.4f, \"runLengths\": [", hitRate);
+        for (int i = 1; i<=62; i++) {
+            printf("%s%ld", i>1 ? ", " : "", s->runLengths[i]);
+        }
+        printf("], \"seconds\": {");
+        for (int i = 0; i<3; i++) {
+            printf("%s\"%s\": %.6f", i ? ", " : "", stageNames[i], s->seconds[i]);
+        }
+        printf("}, \"peakRssKB\": %ld}\n", usage.ru_maxrss);
+        return;
+    }
+
+    printf("%ld pixels, %ld bytes\n", pixels, fileBytes);
+    printf("chunk       count       bytes\n");
+    for (int i = 0; i<6; i++) {
+        printf("%-5s %11ld %11ld\n", chunkNames[i], s->chunks[i], s->chunks[i]*chunkSizes[i]);
+    }
+    printf("palette hit rate: %.2f%% of non-RUN chunks\n", hitRate*100);
+    printf("run lengths:");
+    for (int i = 1; i<=62; i++) {
+        if (s->runLengths[i]) printf(" %d:%ld", i, s->runLengths[i]);
+    }
+    printf("\n");
+    printf("seconds: read %.6f, %s %.6f, write %.6f\n", s->seconds[0], work, s->seconds[1], s->seconds[2]);
+    printf("peak RSS: %ld KB\n", usage.ru_maxrss);
+}
+
+void startAnalytics(Analytics *a, int width, int height) {
+    memset(a, 0, sizeof(Analytics));
+    a->width = width;
+    a->height = height;
+    a->minX = width;
+    a->minY = height;
+    a->maxX = -1;
+    a->maxY = -1;
+    a->opaque = 1;
+    a->hash = 0xcbf29ce484222325ULL;
+}
+
+// count copies of px, the first at pixel index
+void analyzePixels(Analytics *a, PixelRGBA px, long index, int count) {
+    a->histogram[0][px.r] += count;
+    a->histogram[1][px.g] += count;
+    a->histogram[2][px.b] += count;
+    a->histogram[3][px.a] += count;
+    for (int i = 0; i < count; i++) {
+        a->hash = (a->hash ^ px.r) * 0x100000001b3ULL;
+        a->hash = (a->hash ^ px.g) * 0x100000001b3ULL;
+        a->hash = (a->hash ^ px.b) * 0x100000001b3ULL;
+        a->hash = (a->hash ^ px.a) * 0x100000001b3ULL;
+    }
+    if (px.a != 255) a->opaque = 0;
+    if (px.a == 0) return;
+
+    long last = index + count - 1;
+    int y0 = index / a->width;
+    int y1 = last / a->width;
+    int x0 = index % a->width;
+    int x1 = last % a->width;
+    if (y0 != y1) {
+        // a run into the next row covers both the last and the first column
+        x0 = 0;
+        x1 = a->width - 1;
+    }
+    if (x0 < a->minX) a->minX = x0;
+    if (x1 > a->maxX) a->maxX = x1;
+    if (y0 < a->minY) a->minY = y0;
+    if (y1 > a->maxY) a->maxY = y1;
+}
+
+// Sidecar next to the output: outputname.json
+void saveAnalytics(Analytics *a, const char* output) {
+    char filename[4096];
+    snprintf(filename, sizeof(filename), "%s.json", output);
+    FILE* file = fopen(filename, "w");
+    if (!file) {
+        err = OpenFileError;
+        return;
+    }
+    const char* channelNames[] = { "r", "g", "b", "a" };
+    fprintf(file, "{\"width\": %d, \"height\": %d, \"opaque\": %s, \"bbox\": ",
+        a->width, a->height, a->opaque ? "true" : "false");
+    if (a->maxX < a->minX) fprintf(file, "null");
+    else fprintf(file, "[%d, %d, %d, %d]", a->minX, a->minY, a->maxX, a->maxY);
+    fprintf(file, ", \"hash\": \"%016llx\", \"histogram\": {", (unsigned long long) a->hash);
+    for (int c = 0; c < 4; c++) {
+        fprintf(file, "%s\"%s\": [", c ? ", " : "", channelNames[c]);
+        for (int v = 0; v < 256; v++) fprintf(file, "%s%ld", v ? ", " : "", a->histogram[c][v]);
+        fprintf(file, "]");
+    }
+    fprintf(file, "}}\n");
+    err = fclose(file) == 0 ? NoError : WriteFileError;
+}
+
+
+void putBE32(unsigned char* dst, uint32_t value) {
+    dst[0] = value >> 24;
+    dst[1] = value >> 16;
+    dst[2] = value >> 8;
+    dst[3] = value;
+}
+
+uint32_t getBE32(const unsigned char* src) {
+    return ((uint32_t) src[0] << 24) | (src[1] << 16) | (src[2] << 8) | src[3];
+}
+
+uint64_t hashName(const char* name) {
+    // FNV-1a, 0 is reserved for empty slots
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    for (; *name; name++) {
+        hash ^= (unsigned char) *name;
+        hash *= 0x100000001b3ULL;
+    }
+    return hash ? hash : 1;
+}
+
+// Output name: file name without directory and extension
+void spriteName(const char* filename, char* name, size_t size) {
+    const char* base = strrchr(filename, '/');
+    base = base ? base+1 : filename;
+    snprintf(name, size, "%s", base);
+    char* dot = strrchr(name, '.');
+    if (dot && dot != name) *dot = 0;
+}
+
+typedef struct {
+    char* name;
+    long file;
+} NamedFile;
+
+int compareNamedFiles(const void* a, const void* b) {
+    return strcmp(((const NamedFile*) a)->name, ((const NamedFile*) b)->name);
+}
+
+// Tools that write one output per input into a single directory name it after the
+// input's file name. Prints every input that would overwrite another one's output.
+long countNameClashes(FileList *files) {
+    NamedFile* named = malloc((files->count + 1) * sizeof(NamedFile));
+    if (!named) {
+        printf("%s\n", errorMessages[MemAllocError]);
+        return 1;
+    }
+    char name[4096];
+    for (long i = 0; i < files->count; i++) {
+        spriteName(files->names[i], name, sizeof(name));
+        named[i].name = strdup(name);
+        named[i].file = i;
+    }
+    qsort(named, files->count, sizeof(NamedFile), compareNamedFiles);
+
+    long clashes = 0;
+    for (long i = 1; i < files->count; i++) {
+        if (strcmp(named[i-1].name, named[i].name) == 0) {
+            printf("%s: same output name as %s\n", files->names[named[i].file], files->names[named[i-1].file]);
+            clashes++;
+        }
+    }
+    for (long i = 0; i < files->count; i++) free(named[i].name);
+    free(named);
+    return clashes;
+}
+
+// Sprite names become file names under the output directory, so they can't leave it
+int isSafeName(const char* name) {
+    return name[0] != 0 && strchr(name, '/') == NULL && strstr(name, "..") == NULL;
+}
+
+const int adam7[7][6] = { // first column, first row, column step, row step, block width, block height
+    {0,0,8,8,8,8}, {4,0,8,8,4,8}, {0,4,4,8,4,4}, {2,0,4,4,2,4}, {0,2,2,4,2,2}, {1,0,2,2,1,2}, {0,1,1,2,1,1}
+};
+
+int adam7Size(int size, int first, int step) {
+    return size > first ? (size - first + step - 1) / step : 0;
+}
+
+
+double secondsSince(struct timespec start) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start.tv_sec) + (now.tv_nsec - start.tv_nsec) / 1e9;
+}
+
+// Both return the bytes done, less than length if the file ended early or failed
+long readWhole(int fd, unsigned char* buffer, long length) {
+    long done = 0;
+    while (done < length) {
+        ssize_t n = pread(fd, buffer + done, length - done, done);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) break;
+        done += n;
+    }
+    return done;
+}
+
+long writeWhole(int fd, const unsigned char* data, long length) {
+    long done = 0;
+    while (done < length) {
+        ssize_t n = pwrite(fd, data + done, length - done, done);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) break;
+        done += n;
+    }
+    return done;
+}
+
+void addToFileList(FileList *list, const char* name) {
+    if (list->count == list->capacity) {
+        list->capacity = list->capacity ? list->capacity*2 : 1024;
+        list->names = realloc(list->names, list->capacity * sizeof(char*));
+        if (!list->names) {
+            err = MemAllocError;
+            return;
+        }
+    }
+    list->names[list->count++] = strdup(name);
+}
+
+int hasExtension(const char* name, const char* ext) {
+    size_t n = strlen(name), e = strlen(ext);
+    return n > e && strcasecmp(name + n - e, ext) == 0;
+}
+
+// Adds the file itself, or every file with the extension below it if it is a directory
+void collectFiles(const char* path, const char* ext, FileList *list) {
+    struct stat st;
+    if (stat(path, &st) != 0 || !S_ISDIR(st.st_mode)) {
+        addToFileList(list, path);
+        return;
+    }
+    DIR* dir = opendir(path);
+    if (!dir) {
+        addToFileList(list, path);
+        return;
+    }
+    struct dirent* entry;
+    char child[4096];
+    while ((entry = readdir(dir)) != NULL) {
+        if (entry->d_name[0] == '.') continue;
+        snprintf(child, sizeof(child), "%s/%s", path, entry->d_name);
+        if (entry->d_type == DT_DIR || (entry->d_type == DT_UNKNOWN && stat(child, &st) == 0 && S_ISDIR(st.st_mode))) {
+            collectFiles(child, ext, list);
+        }
+        else if (hasExtension(entry->d_name, ext)) {
+            addToFileList(list, child);
+        }
+    }
+    closedir(dir);
+}
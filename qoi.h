@@ -0,0 +1,106 @@
+// What encode, decode and verify share: the pixel type, the palette hash, errors,
+// the --stats and --analytics collectors, and file list helpers.
+#ifndef QOI_H
+#define QOI_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <time.h>
+
+
+typedef struct {
+    unsigned char r, g, b, a;
+} PixelRGBA;
+
+static inline void addToPalette( PixelRGBA pixel, PixelRGBA* palette ) {
+    // Note: assumes minimum 64 length. UB if not.
+    int index = ( pixel.r*3 + pixel.g*5 + pixel.b*7 + pixel.a*11 ) % 64;
+    palette[ index ] = pixel;
+}
+
+// Batch lanes of encodeBatch and decodeBatch: one value per image, pixels packed r | g<<8 |
+// b<<16 | a<<24
+#define BATCH_LANES 4 // one 128-bit register; wider vectors only pay off with AVX
+
+typedef uint32_t Lanes __attribute__((vector_size(4 * BATCH_LANES)));
+
+// a where mask is set, b elsewhere
+static inline Lanes pickLanes( Lanes mask, Lanes a, Lanes b ) {
+    return (a & mask) | (b & ~mask);
+}
+
+// The palette index of addToPalette, for every lane
+static inline Lanes hashLanes( Lanes px ) {
+    return ((px & 255)*3 + (px >> 8 & 255)*5 + (px >> 16 & 255)*7 + (px >> 24)*11) & 63;
+}
+
+
+enum Error { NoError, OpenFileError, ReadFileError, MemAllocError, PngError, WriteFileError,
+    HeaderError, TruncatedError, PixelCountError, FooterError, LzError,
+    EarlyEndError};
+extern _Thread_local enum Error err;
+
+extern char* errorMessages[];
+
+
+typedef struct {
+    long chunks[6];      // indexed by chunk type: RGB, RGBA, INDEX, DIFF, LUMA, RUN
+    long runLengths[63]; // runLengths[n] = RUN chunks covering n pixels
+    double seconds[3];   // the three stages of the tool: read, encode or decode, write
+} Stats;
+
+// Only set by --stats, so the counters are a single predictable branch otherwise
+extern Stats* stats;
+
+void countChunk(Stats *s, int type, int pixelsCovered);
+void printStats(Stats *s, int json, long pixels, long fileBytes, const char* work);
+
+// Only set by --analytics: per-channel histograms, the bounding box of the
+// non-transparent pixels, an opacity flag and a content hash for dedup, gathered from
+// the pixels the chunk loop already holds. encode and decode hash identically.
+typedef struct {
+    long histogram[4][256];
+    int width;
+    int height;
+    int minX, minY, maxX, maxY; // maxX < minX while no visible pixel was seen
+    int opaque;
+    uint64_t hash;              // FNV-1a over r, g, b, a of every pixel in order
+} Analytics;
+
+extern Analytics* analytics;
+
+void startAnalytics(Analytics *a, int width, int height);
+void analyzePixels(Analytics *a, PixelRGBA px, long index, int count);
+void saveAnalytics(Analytics *a, const char* output);
+
+
+// Containers
+#define LZ_BLOCK 65536 // largest block of a qoiz file
+
+void putBE32(unsigned char* dst, uint32_t value);
+uint32_t getBE32(const unsigned char* src);
+uint64_t hashName(const char* name);
+void spriteName(const char* filename, char* name, size_t size);
+int isSafeName(const char* name);
+
+// Adam7 passes of the progressive container
+extern const int adam7[7][6];
+int adam7Size(int size, int first, int step);
+
+
+double secondsSince(struct timespec start);
+long readWhole(int fd, unsigned char* buffer, long length);
+long writeWhole(int fd, const unsigned char* data, long length);
+
+typedef struct {
+    char** names;
+    long count;
+    long capacity;
+} FileList;
+
+void addToFileList(FileList *list, const char* name);
+int hasExtension(const char* name, const char* ext);
+void collectFiles(const char* path, const char* ext, FileList *list);
+long countNameClashes(FileList *files);
+
+#endif
@@ -0,0 +1,929 @@
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "qoi.h"
+#include "qoiDecoder.h"
+
+
+void expandChunkRGB(PixelBuffer *raw, FetchedChunk chunk) {
+    PixelRGBA *cur = raw->data + raw->pixelsAdded;
+    PixelRGBA start = {0,0,0,255}; // initial previous pixel
+    PixelRGBA* prev;
+    if (raw->pixelsAdded==0) {
+        prev = &start;
+    }
+    else {
+        prev = cur-1;
+    }
+    cur->r = chunk.RGB.r;
+    cur->g = chunk.RGB.g;
+    cur->b = chunk.RGB.b;
+    cur->a = prev->a;
+
+    raw->pixelsAdded++;
+}
+void expandChunkRGBA(PixelBuffer *raw, FetchedChunk chunk) {
+    PixelRGBA *cur = raw->data + raw->pixelsAdded;
+    cur->r = chunk.RGBA.r;
+    cur->g = chunk.RGBA.g;
+    cur->b = chunk.RGBA.b;
+    cur->a = chunk.RGBA.a;
+    raw->pixelsAdded++;
+}
+
+void expandChunkRUN(PixelBuffer *raw, FetchedChunk chunk) {
+    PixelRGBA *cur = raw->data + raw->pixelsAdded;
+    PixelRGBA start = {0,0,0,255}; // initial previous pixel
+    PixelRGBA* prev;
+    if (raw->pixelsAdded==0) {
+        prev = &start;
+    }
+    else {
+        prev = cur-1;
+    }
+    for (int i = 0; i<chunk.RUN.run+1; i++) {
+        cur->r = prev->r;
+        cur->g = prev->g;
+        cur->b = prev->b;
+        cur->a = prev->a;
+        raw->pixelsAdded++;
+        cur++;
+    }
+}
+
+void expandChunkDIFF(PixelBuffer *raw, FetchedChunk chunk) {
+    PixelRGBA *cur = raw->data + raw->pixelsAdded;
+    PixelRGBA start = {0,0,0,255}; // initial previous pixel
+    PixelRGBA* prev;
+    if (raw->pixelsAdded==0) {
+        prev = &start;
+    }
+    else {
+        prev = cur-1;
+    }
+    cur->r = prev->r + chunk.DIFF.dr -2;
+    cur->g = prev->g + chunk.DIFF.dg -2;
+    cur->b = prev->b + chunk.DIFF.db -2;
+    cur->a = prev->a;
+    raw->pixelsAdded++;
+}
+
+void expandChunkLUMA(PixelBuffer *raw, FetchedChunk chunk) {
+    PixelRGBA *cur = raw->data + raw->pixelsAdded;
+    PixelRGBA start = {0,0,0,255}; // initial previous pixel
+    PixelRGBA* prev;
+    if (raw->pixelsAdded==0) {
+        prev = &start;
+    }
+    else {
+        prev = cur-1;
+    }
+    cur->g = prev->g + chunk.LUMA.dg - 32;
+    cur->r = prev->r + chunk.LUMA.drdg + chunk.LUMA.dg -32 -8;
+    cur->b = prev->b + chunk.LUMA.dbdg + chunk.LUMA.dg -32 -8;
+    cur->a = prev->a;
+    raw->pixelsAdded++;
+}
+
+void expandChunkINDEX(PixelBuffer *raw, FetchedChunk chunk, PixelRGBA* palette) {
+    PixelRGBA *cur = raw->data + raw->pixelsAdded;
+    cur->r = palette[chunk.INDEX.index].r;
+    cur->g = palette[chunk.INDEX.index].g;
+    cur->b = palette[chunk.INDEX.index].b;
+    cur->a = palette[chunk.INDEX.index].a;
+    raw->pixelsAdded++;
+}
+
+
+FetchedChunk fetchNextChunk( QoifStream *qoif, PixelBuffer raw, PixelRGBA palette[64]) {
+
+    // assuming pixelsProcessed != totalLengthInPixels
+    PixelRGBA* cur = ((PixelRGBA*) raw.data) + raw.pixelsAdded;
+    PixelRGBA start = {0,0,0,255}; // initial previous pixel
+    PixelRGBA* prev;
+    if (raw.pixelsAdded==0) {
+        prev = &start;
+    }
+    else {
+        prev = cur-1;
+    }
+
+    unsigned char* chunk = (qoif->data + qoif->bytesProcessed);
+
+    if ( *chunk==0xfe ) {
+        // RGB
+        if (qoif->bytesProcessed+3 >= qoif->totalLengthInBytes) {
+            // not enough bytes. finalize
+            return (FetchedChunk) {
+                .type = 6,
+            };
+        }
+        else {
+            qoif->bytesProcessed += 4;
+            return (FetchedChunk) {
+                .type = 0,
+                .RGB = {
+                    .r= *(chunk+1),
+                    .g= *(chunk+2),
+                    .b= *(chunk+3),
+                }
+            };
+        }
+    }
+    else if ( *chunk==0xff ) {
+        // RGBA
+        if (qoif->bytesProcessed+4 >= qoif->totalLengthInBytes) {
+            // not enough bytes. finalize
+            return (FetchedChunk) {
+                .type = 6,
+            };
+        }
+        else {
+            qoif->bytesProcessed += 5;
+            return (FetchedChunk) {
+                .type = 1,
+                .RGBA = {
+                    .r= *(chunk+1),
+                    .g= *(chunk+2),
+                    .b= *(chunk+3),
+                    .a= *(chunk+4),
+                }
+            };
+        }
+    }
+    else if ( *chunk>>6 == 1 ) {
+        // DIFF
+        unsigned char dr = (*chunk >> 4) & 3;
+        unsigned char dg = (*chunk >> 2) & 3;
+        unsigned char db = (*chunk) & 3;
+        qoif->bytesProcessed += 1;
+        return (FetchedChunk) {
+            .type = 3,
+            .DIFF = {
+                .dr = dr,
+                .dg = dg,
+                .db = db
+            }
+        };
+    }
+    else if ( *chunk>>6 == 2 ) {
+        // LUMA
+        if (qoif->bytesProcessed+1 >= qoif->totalLengthInBytes) {
+            // not enough bytes. finalize
+            return (FetchedChunk) {
+                .type = 6,
+            };
+        }
+        unsigned char dg = (*chunk) & 0x3f;
+        unsigned char drdg = (*(chunk+1) >> 4) & 0xf;
+        unsigned char dbdg = (*(chunk+1)) & 0xf;
+        qoif->bytesProcessed += 2;
+        return (FetchedChunk) {
+            .type = 4,
+            .LUMA = {
+                .dg = dg,
+                .drdg = drdg,
+                .dbdg = dbdg
+            }
+        };
+    }
+    else if ( *chunk>>6 == 3 ) {
+        // RUN
+        unsigned char run = (*chunk) & 0x3f;
+        qoif->bytesProcessed += 1;
+        return (FetchedChunk) {
+            .type = 5,
+            .RUN = {
+                .run = run,
+            }
+        };
+    }
+    else if ( *chunk>>6 == 0 ) {
+        // INDEX
+        unsigned char index = (*chunk) & 0x3f;
+        qoif->bytesProcessed += 1;
+        return (FetchedChunk) {
+            .type = 2,
+            .INDEX = {
+                .index = index,
+            }
+        };
+    } 
+
+    return (FetchedChunk) {
+        .type = 6
+    };
+
+}
+
+
+// LZ back end ("qoiz", see encode --lz for the layout). Blocks are expanded one at a
+// time into a small per-thread window just ahead of fetchNextChunk, so the unpacked
+// QOI stream never exists in memory as a whole.
+
+#define LZ_LOOKAHEAD 16 // more than the longest chunk plus the end marker check
+
+_Thread_local unsigned char lzWindow[LZ_LOOKAHEAD + LZ_BLOCK];
+
+
+int readLzLength(const unsigned char* in, long length, long* pos, long* value) {
+    unsigned char byte;
+    do {
+        if (*pos >= length) return 0;
+        byte = in[(*pos)++];
+        *value += byte;
+    } while (byte == 255);
+    return 1;
+}
+
+// Returns the number of bytes written to out, -1 if the block is corrupt
+long decompressLzBlock(const unsigned char* in, long length, unsigned char* out, long capacity) {
+    long pos = 0;
+    long written = 0;
+    while (pos < length) {
+        unsigned char token = in[pos++];
+        long literalCount = token >> 4;
+        if (literalCount == 15 && !readLzLength(in, length, &pos, &literalCount)) return -1;
+        if (literalCount > length - pos || literalCount > capacity - written) return -1;
+        memcpy(out + written, in + pos, literalCount);
+        pos += literalCount;
+        written += literalCount;
+        if (pos == length) break; // the last sequence has no match
+
+        if (pos + 2 > length) return -1;
+        long offset = in[pos] | (in[pos+1] << 8);
+        pos += 2;
+        long matchLength = (token & 15) + 4;
+        if ((token & 15) == 15 && !readLzLength(in, length, &pos, &matchLength)) return -1;
+        if (offset == 0 || offset > written || matchLength > capacity - written) return -1;
+        unsigned char* dst = out + written;
+        const unsigned char* src = dst - offset;
+        if (offset >= matchLength) memcpy(dst, src, matchLength);
+        else for (long i = 0; i < matchLength; i++) dst[i] = src[i]; // overlapping repeat
+        written += matchLength;
+    }
+    return written;
+}
+
+// Keeps at least LZ_LOOKAHEAD unread bytes in the window while blocks remain
+void refillLzWindow( QoifStream *qoif ) {
+    while (qoif->packed && qoif->totalLengthInBytes - qoif->bytesProcessed < LZ_LOOKAHEAD) {
+        if (qoif->packedLength == 0) {
+            qoif->packed = NULL;
+            break;
+        }
+        long rawLength = qoif->packedLength >= 8 ? getBE32(qoif->packed) : 0;
+        long packedLength = qoif->packedLength >= 8 ? getBE32(qoif->packed + 4) : 0;
+        if (rawLength == 0 || rawLength > LZ_BLOCK || packedLength > qoif->packedLength - 8) {
+            qoif->packed = NULL;
+            err = LzError;
+            break;
+        }
+
+        long tail = qoif->totalLengthInBytes - qoif->bytesProcessed;
+        memmove(lzWindow, lzWindow + qoif->bytesProcessed, tail);
+        if (packedLength == rawLength) {
+            memcpy(lzWindow + tail, qoif->packed + 8, rawLength);
+        }
+        else if (decompressLzBlock(qoif->packed + 8, packedLength, lzWindow + tail, rawLength) != rawLength) {
+            qoif->packed = NULL;
+            err = LzError;
+            break;
+        }
+        qoif->bytesProcessed = 0;
+        qoif->totalLengthInBytes = tail + rawLength;
+        qoif->packed += 8 + packedLength;
+        qoif->packedLength -= 8 + packedLength;
+    }
+}
+
+// Takes over an encoded buffer and allocates the raw image for it
+void openQoifBuffer(unsigned char* data, long length, QoifStream *qoif, PixelBuffer *image) {
+    qoif->packed = NULL;
+    if (length >= 8 && memcmp(data, "qoiz", 4) == 0) {
+        // read on from the first unpacked block, the window holds the header too
+        qoif->packed = data + 8;
+        qoif->packedLength = length - 8;
+        qoif->bytesProcessed = 0;
+        qoif->totalLengthInBytes = 0;
+        err = NoError;
+        refillLzWindow(qoif);
+        if (err != NoError) return;
+        data = lzWindow;
+        length = qoif->totalLengthInBytes;
+    }
+
+    qoif->data = data;
+    qoif->totalLengthInBytes = length;
+    qoif->bytesProcessed = 14; // skip the header
+
+    if (length < 14) {
+        err = ReadFileError;
+        return;
+    }
+
+    // Allocate for raw image
+    qoif->width = qoif->data[4]*(1<<24) + qoif->data[5]*(1<<16) + qoif->data[6]*(1<<8) + qoif->data[7];
+    qoif->height = qoif->data[8]*(1<<24) + qoif->data[9]*(1<<16) + qoif->data[10]*(1<<8) + qoif->data[11];
+
+    if (!image) {
+        // the caller brings its own output, see decodeToLayout
+        err = NoError;
+        return;
+    }
+
+    // a corrupt RUN may overshoot the image by up to 62 pixels
+    image->data = (PixelRGBA*)malloc( ((long) qoif->width * qoif->height + 62) * 4 );
+    if (!image->data) {
+        err = MemAllocError;
+        return;
+    }
+
+    image->pixelsAdded = 0;
+    err = NoError;
+}
+
+
+
+// Walks the chunk stream without expanding pixels. Returns the first problem found;
+// offset is where it was found, pixels how many pixels the chunks covered until then.
+// A qoiz file is unpacked first, its offsets are then those of the unpacked stream.
+enum Error validateQoif(unsigned char* data, long length, long *offset, long *pixels) {
+    const unsigned char footer[8] = {0,0,0,0,0,0,0,1};
+    *pixels = 0;
+    *offset = 0;
+
+    if (length >= 8 && memcmp(data, "qoiz", 4) == 0) {
+        long declared = qoizLength(data, length);
+        if (declared < 0) return LzError;
+        unsigned char* unpacked = malloc(declared + 1);
+        if (!unpacked) return MemAllocError;
+        long unpackedLength = unpackQoiz(data, length, unpacked);
+        enum Error result = unpackedLength < 0 ? LzError : validateQoif(unpacked, unpackedLength, offset, pixels);
+        free(unpacked);
+        return result;
+    }
+
+    if (length < 14 || data[0]!='q' || data[1]!='o' || data[2]!='i' || data[3]!='f') return HeaderError;
+    long width = data[4]*(1L<<24) + data[5]*(1<<16) + data[6]*(1<<8) + data[7];
+    long height = data[8]*(1L<<24) + data[9]*(1<<16) + data[10]*(1<<8) + data[11];
+    *offset = 4;
+    if (width==0 || height==0) return HeaderError;
+    *offset = 12;
+    if (data[12]!=3 && data[12]!=4) return HeaderError;
+    *offset = 13;
+    if (data[13]>1) return HeaderError;
+
+    long total = width*height;
+    long pos = 14;
+    while (*pixels < total) {
+        *offset = pos;
+        if (pos >= length) return TruncatedError;
+        if (pos == length-8 && memcmp(data+pos, footer, 8) == 0) return EarlyEndError;
+
+        unsigned char tag = data[pos];
+        int size = 1;
+        int covered = 1;
+        if (tag==0xfe) size = 4;
+        else if (tag==0xff) size = 5;
+        else if (tag>>6 == 2) size = 2;
+        else if (tag>>6 == 3) covered = (tag & 0x3f) + 1;
+
+        if (pos + size > length) return TruncatedError;
+        if (*pixels + covered > total) return PixelCountError;
+        *pixels += covered;
+        pos += size;
+    }
+
+    *offset = pos;
+    if (length - pos < 8 || memcmp(data+pos, footer, 8) != 0) return FooterError;
+    *offset = pos + 8;
+    if (length != pos + 8) return FooterError;
+    return NoError;
+}
+
+
+void decodeBody( QoifStream *qoif, PixelBuffer *raw ) {
+    PixelRGBA palette[64] = {0};
+
+    while(1) {
+        if (qoif->packed) refillLzWindow(qoif);
+        if (qoif->bytesProcessed + 8 >= qoif->totalLengthInBytes) break;
+        if (raw->pixelsAdded >= (long) qoif->width * qoif->height) break;
+
+
+        long first = raw->pixelsAdded;
+        FetchedChunk chunk = fetchNextChunk(qoif, *raw, palette);
+        if (chunk.type == 0) expandChunkRGB(raw, chunk);
+        if (chunk.type == 1) expandChunkRGBA(raw, chunk);
+        if (chunk.type == 2) expandChunkINDEX(raw, chunk, palette);
+        if (chunk.type == 3) expandChunkDIFF(raw, chunk);
+        if (chunk.type == 4) expandChunkLUMA(raw, chunk);
+        if (chunk.type == 5) expandChunkRUN(raw, chunk);
+        if (chunk.type == 6) break;
+        if (stats) countChunk(stats, chunk.type, chunk.type == 5 ? chunk.RUN.run + 1 : 1);
+
+        PixelRGBA* lastPixel = raw->data + raw->pixelsAdded - 1;
+        addToPalette(*lastPixel, palette);
+        if (analytics) analyzePixels(analytics, *lastPixel, first, raw->pixelsAdded - first);
+    }
+    // the chunks ran out before the image was complete
+    if (err == NoError && raw->pixelsAdded < (long) qoif->width * qoif->height) err = TruncatedError;
+}
+
+
+// Decoding straight into a caller-described layout (decode --layout). The chunk
+// expansion below is a fused copy of fetchNextChunk and the expandChunk* functions that
+// keeps the previous pixel in a register and stores every pixel once, at its final place.
+// Colorspace, alpha and channel order conversions (--linear, --srgb, --premultiply,
+// --swizzle) happen on the way out, so prediction still sees the stored pixels.
+
+// Anything beyond a plain copy of the stored pixels
+int needsConversion( Layout *layout, int storedColorspace ) {
+    return (layout->colorspace >= 0 && layout->colorspace != storedColorspace) || layout->premultiply ||
+        layout->order[0] != 0 || layout->order[1] != 1 || layout->order[2] != 2 || layout->order[3] != 3;
+}
+
+double srgbToLinear(double v) {
+    return v <= 0.04045 ? v / 12.92 : pow((v + 0.055) / 1.055, 2.4);
+}
+
+double linearToSrgb(double v) {
+    return v <= 0.0031308 ? v * 12.92 : 1.055 * pow(v, 1 / 2.4) - 0.055;
+}
+
+void buildCurve( Layout *layout, int storedColorspace ) {
+    for (int v = 0; v < 256; v++) {
+        double x = v / 255.0;
+        if (layout->colorspace == 1 && storedColorspace == 0) x = srgbToLinear(x);
+        if (layout->colorspace == 0 && storedColorspace == 1) x = linearToSrgb(x);
+        layout->curve[v] = (unsigned char) (x * 255 + 0.5);
+        layout->transfer[v] = x * 255;
+    }
+}
+
+static inline __attribute__((always_inline))
+PixelRGBA convertPixel( Layout *layout, PixelRGBA px ) {
+    unsigned char c[4] = { layout->curve[px.r], layout->curve[px.g], layout->curve[px.b], px.a };
+    if (layout->premultiply) {
+        for (int k = 0; k < 3; k++) c[k] = (c[k] * px.a + 127) / 255;
+    }
+    return (PixelRGBA) { c[layout->order[0]], c[layout->order[1]], c[layout->order[2]], c[layout->order[3]] };
+}
+
+// Bytes the output of decodeToLayout takes
+long layoutSize( Layout *layout, int width, int height ) {
+    long plane = (long) width * height;
+    if (layout->format == 0) return layout->pitch * height;
+    if (layout->format == 1) return plane * layout->channels;
+    return plane * layout->channels * sizeof(float);
+}
+
+static inline __attribute__((always_inline))
+void storePixel( Layout *layout, int format, int convert, unsigned char* row, int x, unsigned char* out, long i, long plane, PixelRGBA px ) {
+    if (convert && format != 2) px = convertPixel(layout, px);
+    if (format == 0) {
+        memcpy(row + x*4, &px, 4);
+    }
+    else if (format == 1) {
+        out[i] = px.r;
+        out[plane + i] = px.g;
+        out[2*plane + i] = px.b;
+        if (layout->channels == 4) out[3*plane + i] = px.a;
+    }
+    else if (!convert) {
+        float* planes = (float*) out;
+        planes[i] = layout->lut[0][px.r];
+        planes[plane + i] = layout->lut[1][px.g];
+        planes[2*plane + i] = layout->lut[2][px.b];
+        if (layout->channels == 4) planes[3*plane + i] = layout->lut[3][px.a];
+    }
+    else {
+        // lut[k] already holds the colorspace curve of the channel it reads, and alpha is
+        // multiplied in as a float, so nothing is rounded to a byte on the way
+        unsigned char c[4] = { px.r, px.g, px.b, px.a };
+        float alpha = layout->premultiply ? px.a / 255.f : 1;
+        float* planes = (float*) out;
+        for (int k = 0; k < layout->channels; k++) {
+            int from = layout->order[k];
+            float v = layout->lut[k][c[from]];
+            if (from < 3) v = (v - layout->bias[k]) * alpha + layout->bias[k];
+            planes[k*plane + i] = v;
+        }
+    }
+}
+
+// Inlined once per format, conversion and collection, so the store is picked at compile
+// time and the plain decode pays nothing for --stats and --analytics
+static inline __attribute__((always_inline))
+long expandToLayout( QoifStream *qoif, Layout *layout, unsigned char* out, int format, int convert, int collect ) {
+    PixelRGBA palette[64] = {0};
+    PixelRGBA px = {0,0,0,255};
+    long total = (long) qoif->width * qoif->height;
+    long i = 0;
+    int x = 0;
+    unsigned char* row = out;
+
+    while (i < total) {
+        if (qoif->packed) refillLzWindow(qoif);
+        // past this check at least 9 bytes are left, enough for any chunk
+        if (qoif->bytesProcessed + 8 >= qoif->totalLengthInBytes) break;
+
+        unsigned char* chunk = qoif->data + qoif->bytesProcessed;
+        unsigned char tag = chunk[0];
+        long run = 1;
+        int type;
+        if (tag == 0xfe) {
+            px.r = chunk[1];
+            px.g = chunk[2];
+            px.b = chunk[3];
+            type = 0;
+            qoif->bytesProcessed += 4;
+        }
+        else if (tag == 0xff) {
+            px.r = chunk[1];
+            px.g = chunk[2];
+            px.b = chunk[3];
+            px.a = chunk[4];
+            type = 1;
+            qoif->bytesProcessed += 5;
+        }
+        else if (tag >> 6 == 0) {
+            px = palette[tag];
+            type = 2;
+            qoif->bytesProcessed += 1;
+        }
+        else if (tag >> 6 == 1) {
+            px.r += ((tag >> 4) & 3) - 2;
+            px.g += ((tag >> 2) & 3) - 2;
+            px.b += (tag & 3) - 2;
+            type = 3;
+            qoif->bytesProcessed += 1;
+        }
+        else if (tag >> 6 == 2) {
+            int dg = (tag & 0x3f) - 32;
+            px.r += dg - 8 + (chunk[1] >> 4);
+            px.g += dg;
+            px.b += dg - 8 + (chunk[1] & 0xf);
+            type = 4;
+            qoif->bytesProcessed += 2;
+        }
+        else {
+            run = (tag & 0x3f) + 1;
+            type = 5;
+            qoif->bytesProcessed += 1;
+        }
+        if (collect && stats) countChunk(stats, type, run);
+        if (run > total - i) run = total - i;
+        palette[( px.r*3 + px.g*5 + px.b*7 + px.a*11 ) % 64] = px;
+        if (collect && analytics) analyzePixels(analytics, px, i, run); // the stored pixel, as decodeBody sees it
+
+        for (; run > 0; run--, i++) {
+            storePixel(layout, format, convert, row, x, out, i, total, px);
+            if (format == 0 && ++x == qoif->width) {
+                x = 0;
+                row += layout->pitch;
+            }
+        }
+    }
+    return i;
+}
+
+static inline __attribute__((always_inline))
+long expandFormat( QoifStream *qoif, Layout *layout, unsigned char* out, int format, int convert ) {
+    if (stats || analytics) {
+        return convert ? expandToLayout(qoif, layout, out, format, 1, 1) : expandToLayout(qoif, layout, out, format, 0, 1);
+    }
+    return convert ? expandToLayout(qoif, layout, out, format, 1, 0) : expandToLayout(qoif, layout, out, format, 0, 0);
+}
+
+// Returns the number of pixels written, the rest of out is left as it was
+long decodeToLayout( QoifStream *qoif, Layout *layout, unsigned char* out ) {
+    int storedColorspace = qoif->data[13];
+    buildCurve(layout, storedColorspace);
+    int convert = needsConversion(layout, storedColorspace);
+    if (layout->format == 0) return expandFormat(qoif, layout, out, 0, convert);
+    if (layout->format == 1) return expandFormat(qoif, layout, out, 1, convert);
+    // a converted lut is indexed by the input channel that output channel c reads
+    for (int c = 0; c < 4; c++) {
+        int curved = convert && layout->order[c] < 3;
+        for (int v = 0; v < 256; v++) layout->lut[c][v] = (curved ? layout->transfer[v] : v) * layout->scale[c] + layout->bias[c];
+    }
+    return expandFormat(qoif, layout, out, 2, convert);
+}
+
+
+// Progressive container ("qprg", see encode --progressive for the layout), decoded as
+// the bytes arrive. Every pixel of a pass is also spread over the block of the image it
+// stands for until a later pass fills in the detail, so the image is usable after the
+// first pass and refines in place.
+
+void placePassPixel( ProgressiveDecoder *dec, PixelRGBA px ) {
+    const int* p = adam7[dec->pass];
+    int x = p[0] + (dec->pixelIndex % dec->passWidth) * p[2];
+    int y = p[1] + (dec->pixelIndex / dec->passWidth) * p[3];
+    int endX = x + p[4] < dec->width ? x + p[4] : dec->width;
+    int endY = y + p[5] < dec->height ? y + p[5] : dec->height;
+    for (int by = y; by < endY; by++) {
+        PixelRGBA* row = dec->image + (long) by * dec->width;
+        for (int bx = x; bx < endX; bx++) row[bx] = px;
+    }
+    dec->pixelIndex++;
+}
+
+// Decodes one chunk if all of it is there, returns its length or 0
+int decodePassChunk( ProgressiveDecoder *dec, long available ) {
+    unsigned char* chunk = dec->data + dec->pos;
+    unsigned char tag = chunk[0];
+    int length = tag == 0xfe ? 4 : tag == 0xff ? 5 : tag >> 6 == 2 ? 2 : 1;
+    if (length > available) return 0;
+
+    PixelRGBA px = dec->prev;
+    int run = 1;
+    if (tag == 0xfe) {
+        px.r = chunk[1];
+        px.g = chunk[2];
+        px.b = chunk[3];
+    }
+    else if (tag == 0xff) {
+        px = (PixelRGBA) { chunk[1], chunk[2], chunk[3], chunk[4] };
+    }
+    else if (tag >> 6 == 0) {
+        px = dec->palette[tag];
+    }
+    else if (tag >> 6 == 1) {
+        px.r += ((tag >> 4) & 3) - 2;
+        px.g += ((tag >> 2) & 3) - 2;
+        px.b += (tag & 3) - 2;
+    }
+    else if (tag >> 6 == 2) {
+        int dg = (tag & 0x3f) - 32;
+        px.r += dg - 8 + (chunk[1] >> 4);
+        px.g += dg;
+        px.b += dg - 8 + (chunk[1] & 0xf);
+    }
+    else {
+        run = (tag & 0x3f) + 1;
+    }
+    addToPalette(px, dec->palette);
+    dec->prev = px;
+    for (; run > 0 && dec->pixelIndex < dec->passPixels; run--) placePassPixel(dec, px);
+    return length;
+}
+
+// Decodes as far as the bytes received allow, returns 1 each time a pass completes
+int advanceProgressive( ProgressiveDecoder *dec ) {
+    if (dec->pass < 0) {
+        if (dec->received < 14) return 0;
+        if (memcmp(dec->data, "qprg", 4) != 0) {
+            err = HeaderError;
+            return 0;
+        }
+        dec->width = getBE32(dec->data + 4);
+        dec->height = getBE32(dec->data + 8);
+        dec->image = calloc((long) dec->width * dec->height + 1, sizeof(PixelRGBA));
+        if (!dec->image) {
+            err = MemAllocError;
+            return 0;
+        }
+        dec->pos = 14;
+        dec->pass = 0;
+    }
+    if (dec->pass >= 7) return 0;
+
+    if (dec->passEnd == 0) {
+        // the pass's length and its QOI header
+        if (dec->received - dec->pos < 4 + 14) return 0;
+        const int* p = adam7[dec->pass];
+        dec->passEnd = dec->pos + 4 + getBE32(dec->data + dec->pos);
+        dec->passWidth = adam7Size(dec->width, p[0], p[2]);
+        int passHeight = adam7Size(dec->height, p[1], p[3]);
+        dec->passPixels = (long) dec->passWidth * passHeight;
+        // both sizes have to be the pass's, or its pixels would land outside its rows
+        if (getBE32(dec->data + dec->pos + 8) != (uint32_t) dec->passWidth ||
+            getBE32(dec->data + dec->pos + 12) != (uint32_t) passHeight || dec->passEnd < dec->pos + 4 + 22) {
+            err = HeaderError;
+            return 0;
+        }
+        dec->pos += 4 + 14;
+        dec->pixelIndex = 0;
+        dec->prev = (PixelRGBA) {0,0,0,255};
+        memset(dec->palette, 0, sizeof(dec->palette));
+    }
+
+    long chunksEnd = dec->passEnd - 8; // the end marker
+    long available = (dec->received < chunksEnd ? dec->received : chunksEnd);
+    while (dec->pixelIndex < dec->passPixels && dec->pos < available) {
+        int length = decodePassChunk(dec, available - dec->pos);
+        if (length == 0) return 0;
+        dec->pos += length;
+    }
+    if (dec->pixelIndex < dec->passPixels && dec->received < chunksEnd) return 0;
+    if (dec->pixelIndex < dec->passPixels) {
+        err = PixelCountError; // the chunks ran out before the pass was complete
+        return 0;
+    }
+    if (dec->received < dec->passEnd) return 0;
+    if (dec->pos != chunksEnd || memcmp(dec->data + chunksEnd, "\0\0\0\0\0\0\0\1", 8) != 0) {
+        err = FooterError;
+        return 0;
+    }
+
+    dec->pos = dec->passEnd;
+    dec->passEnd = 0;
+    dec->pass++;
+    return 1;
+}
+
+void feedProgressive( ProgressiveDecoder *dec, const unsigned char* bytes, long length ) {
+    if (dec->received + length > dec->capacity) {
+        dec->capacity = (dec->received + length) * 2;
+        unsigned char* data = realloc(dec->data, dec->capacity);
+        if (!data) {
+            err = MemAllocError;
+            return;
+        }
+        dec->data = data;
+    }
+    memcpy(dec->data + dec->received, bytes, length);
+    dec->received += length;
+}
+
+
+// Batch decoder (decode --batch) for piles of tiny images. decodeBatch expands
+// BATCH_LANES validated streams in step, one pixel of each at a time. The chunk is
+// picked apart on vectors holding one value per lane, with masks instead of branches;
+// only the palette, input and output, different memory for every lane, are handled
+// lane by lane. A lane without an image is parked on a RUN that never ends and writes
+// to a scratch pixel.
+
+typedef struct {
+    uint32_t palette[BATCH_LANES][64];
+    unsigned char* in[BATCH_LANES];
+    uint32_t* out[BATCH_LANES];
+    long left[BATCH_LANES];
+    Lanes prev;
+    Lanes run;    // pixels the current RUN chunk still covers
+    Lanes busy;   // set where the lane has an image
+} BatchLanes;
+
+static inline __attribute__((always_inline)) void decodeLanes( BatchLanes *b ) {
+    Lanes tag, bytes, indexed;
+    // tag, the four bytes after it and the palette entry the tag would index, per lane
+    #pragma GCC unroll 8
+    for (int l = 0; l < BATCH_LANES; l++) {
+        tag[l] = b->in[l][0];
+        memcpy(&bytes[l], b->in[l] + 1, 4);
+        indexed[l] = b->palette[l][tag[l] & 63];
+    }
+    Lanes prev = b->prev;
+    Lanes inRun = (Lanes) (b->run != 0);
+    Lanes op = tag >> 6;
+    Lanes isDiff = (Lanes) (op == 1);
+    Lanes isRGB = (Lanes) (tag == 0xfe);
+    Lanes isRGBA = (Lanes) (tag == 0xff);
+    Lanes isRun = (Lanes) (op == 3) & ~isRGB & ~isRGBA;
+
+    // DIFF and LUMA add to r, g and b of prev, each channel wrapping on its own
+    Lanes dg = pickLanes(isDiff, (tag >> 2 & 3) - 2, (tag & 63) - 32);
+    Lanes dr = pickLanes(isDiff, (tag >> 4 & 3) - 2, dg - 8 + (bytes >> 4 & 15));
+    Lanes db = pickLanes(isDiff, (tag & 3) - 2, dg - 8 + (bytes & 15));
+    Lanes px = ((prev + dr) & 255) | (((prev >> 8) + dg) & 255) << 8 | (((prev >> 16) + db) & 255) << 16 | (prev & 0xff000000);
+    px = pickLanes((Lanes) (op == 0), indexed, px);
+    px = pickLanes(isRGB, (bytes & 0xffffff) | (prev & 0xff000000), px);
+    px = pickLanes(isRGBA, bytes, px);
+    px = pickLanes(isRun | inRun, prev, px);
+
+    Lanes length = pickLanes(isRGBA, (Lanes) {0} + 5, pickLanes(isRGB, (Lanes) {0} + 4, 1 - (Lanes) (op == 2)));
+    length &= ~inRun;
+    b->run = pickLanes(inRun, b->run - 1, tag & 63 & isRun);
+    // within a RUN this stores the same pixel in the same slot again
+    Lanes index = hashLanes(px);
+    #pragma GCC unroll 8
+    for (int l = 0; l < BATCH_LANES; l++) {
+        b->palette[l][index[l]] = px[l];
+        *b->out[l] = px[l];
+        b->out[l] += b->busy[l] & 1;
+        b->in[l] += length[l];
+    }
+    b->prev = px;
+}
+
+// Expands count validated streams, stream i from its first chunk at inputs[i] into the
+// pixels[i] pixels at outputs[i]
+void decodeBatch( unsigned char** inputs, long* pixels, int count, PixelRGBA** outputs ) {
+    BatchLanes b;
+    unsigned char parkedInput[5] = {0};
+    uint32_t parkedOutput;
+    int queued = 0;
+    int busy = 0;
+    for (int l = 0; l < BATCH_LANES; l++) {
+        b.in[l] = parkedInput;
+        b.out[l] = &parkedOutput;
+        b.busy[l] = 0;
+    }
+
+    while (1) {
+        for (int l = 0; l < BATCH_LANES && queued < count; l++) {
+            if (b.busy[l]) continue;
+            memset(b.palette[l], 0, sizeof(b.palette[l]));
+            b.in[l] = inputs[queued];
+            b.out[l] = (uint32_t*) outputs[queued];
+            b.left[l] = pixels[queued++];
+            b.prev[l] = 0xff000000;
+            b.run[l] = 0;
+            b.busy[l] = -1;
+            busy++;
+        }
+        if (busy == 0) break;
+
+        // all lanes go the same number of steps, until the shortest image is done, and
+        // not so many that a parked lane's RUN could end
+        long steps = UINT32_MAX / 2;
+        for (int l = 0; l < BATCH_LANES; l++) {
+            if (!b.busy[l]) b.run[l] = UINT32_MAX;
+            else if (b.left[l] < steps) steps = b.left[l];
+        }
+        for (long s = 0; s < steps; s++) decodeLanes(&b);
+        for (int l = 0; l < BATCH_LANES; l++) {
+            if (!b.busy[l] || (b.left[l] -= steps) > 0) continue;
+            b.in[l] = parkedInput;
+            b.out[l] = &parkedOutput;
+            b.busy[l] = 0;
+            busy--;
+        }
+    }
+}
+
+
+// The 14-byte QOI header of a qoiz file, unpacked from no more than its first bytes
+// (decode --scan). 0 if those bytes don't reach it or the block is corrupt.
+int peekQoizHeader( const unsigned char* data, long length, unsigned char header[14] ) {
+    if (length < 16 || memcmp(data, "qoiz", 4) != 0) return 0;
+    long rawLength = getBE32(data + 8);
+    long packedLength = getBE32(data + 12);
+    const unsigned char* in = data + 16;
+    long inLength = length - 16 < packedLength ? length - 16 : packedLength;
+    if (rawLength < 14) return 0;
+    if (packedLength == rawLength) {
+        if (inLength < 14) return 0;
+        memcpy(header, in, 14);
+        return 1;
+    }
+
+    long pos = 0;
+    long written = 0;
+    while (written < 14) {
+        if (pos >= inLength) return 0;
+        unsigned char token = in[pos++];
+        long literalCount = token >> 4;
+        if (literalCount == 15 && !readLzLength(in, inLength, &pos, &literalCount)) return 0;
+        for (; literalCount > 0 && written < 14; literalCount--) {
+            if (pos >= inLength) return 0;
+            header[written++] = in[pos++];
+        }
+        if (written == 14) break;
+
+        if (pos + 2 > inLength) return 0;
+        long offset = in[pos] | (in[pos+1] << 8);
+        pos += 2;
+        long matchLength = (token & 15) + 4;
+        if ((token & 15) == 15 && !readLzLength(in, inLength, &pos, &matchLength)) return 0;
+        if (offset == 0 || offset > written) return 0;
+        for (; matchLength > 0 && written < 14; matchLength--, written++) header[written] = header[written - offset];
+    }
+    return 1;
+}
+
+// The unpacked length a qoiz file declares, or -1 if its blocks couldn't hold that much
+// or no stream of the image's size is that long. Checked before anything is allocated.
+long qoizLength( const unsigned char* data, long length ) {
+    unsigned char header[14];
+    if (!peekQoizHeader(data, length, header)) return -1;
+    long declared = getBE32(data + 4);
+    double largest = (double) getBE32(header + 4) * getBE32(header + 8) * 5 + 22;
+    if (declared > (length - 8) / 8 * LZ_BLOCK || declared > largest) return -1;
+    return declared;
+}
+
+// Unpacks a whole "qoiz" file into out, which has room for the stream length its header
+// gives. Returns that length, -1 if the file is corrupt.
+long unpackQoiz( const unsigned char* data, long length, unsigned char* out ) {
+    long total = getBE32(data + 4);
+    long pos = 8;
+    long written = 0;
+    while (pos < length) {
+        if (length - pos < 8) return -1;
+        long rawLength = getBE32(data + pos);
+        long packedLength = getBE32(data + pos + 4);
+        pos += 8;
+        if (rawLength == 0 || rawLength > LZ_BLOCK || rawLength > total - written || packedLength > length - pos) return -1;
+        if (packedLength == rawLength) memcpy(out + written, data + pos, rawLength);
+        else if (decompressLzBlock(data + pos, packedLength, out + written, rawLength) != rawLength) return -1;
+        pos += packedLength;
+        written += rawLength;
+    }
+    return written == total ? total : -1;
+}
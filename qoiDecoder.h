@@ -0,0 +1,91 @@
+// The decoder core: everything that turns QOI and qoiz back into pixels, shared by
+// decode and verify
+#ifndef QOI_DECODER_H
+#define QOI_DECODER_H
+
+#include "qoi.h"
+
+
+typedef struct {
+    unsigned char* data;
+    int width;
+    int height;
+    long bytesProcessed;
+    long totalLengthInBytes;
+    unsigned char* packed; // qoiz blocks not yet unpacked, NULL for a plain QOI stream
+    long packedLength;
+} QoifStream;
+
+typedef struct {
+    PixelRGBA* data;  // Pointer to RGB or RGBA data
+    long pixelsAdded;
+} PixelBuffer;
+
+typedef struct {
+    int type; // 0=RGB, 1=RGBA, 2=INDEX, 3=DIFF, 4=LUMA, 5=RUN, 6=NONE
+    union {
+        struct { unsigned char r, g, b; } RGB;
+        struct { unsigned char r, g, b, a; } RGBA;
+        struct { unsigned char index; } INDEX;
+        struct { unsigned char dr, dg, db; } DIFF;
+        struct { unsigned char dg, drdg, dbdg; } LUMA;
+        struct { unsigned char run; } RUN;
+    };
+} FetchedChunk;
+
+// Output description for decodeToLayout (decode --layout)
+typedef struct {
+    int format;        // 0 = interleaved RGBA, 1 = planar bytes, 2 = CHW float32
+    int channels;      // planes written by the planar formats, 3 or 4
+    long pitch;        // bytes per row of interleaved output
+    float scale[4];    // CHW: value = byte * scale + bias, per channel
+    float bias[4];
+    int colorspace;    // wanted output colorspace, -1 = as stored
+    int premultiply;
+    int order[4];      // output channel i is input channel order[i]
+    unsigned char curve[256]; // filled in by decodeToLayout: colorspace conversion of r, g, b
+    float transfer[256];      // the same conversion unrounded, in 0..255, for CHW
+    float lut[4][256]; // filled in by decodeToLayout from transfer, scale and bias
+} Layout;
+
+// Progressive container decoder, fed as the bytes arrive
+typedef struct {
+    unsigned char* data; // everything received so far
+    long received;
+    long capacity;
+    long pos;            // next byte to decode
+    int width;
+    int height;
+    PixelRGBA* image;
+    int pass;            // -1 before the header, 7 when done
+    long passEnd;        // end of the current pass's stream, 0 before its length is known
+    int passWidth;
+    long passPixels;
+    long pixelIndex;
+    PixelRGBA palette[64];
+    PixelRGBA prev;
+} ProgressiveDecoder;
+
+
+FetchedChunk fetchNextChunk( QoifStream *qoif, PixelBuffer raw, PixelRGBA palette[64]);
+long decompressLzBlock(const unsigned char* in, long length, unsigned char* out, long capacity);
+long qoizLength( const unsigned char* data, long length );
+long unpackQoiz( const unsigned char* data, long length, unsigned char* out );
+int peekQoizHeader( const unsigned char* data, long length, unsigned char header[14] );
+void refillLzWindow( QoifStream *qoif );
+void openQoifBuffer(unsigned char* data, long length, QoifStream *qoif, PixelBuffer *image);
+enum Error validateQoif(unsigned char* data, long length, long *offset, long *pixels);
+void decodeBody( QoifStream *qoif, PixelBuffer *raw );
+
+int needsConversion( Layout *layout, int storedColorspace );
+double srgbToLinear(double v);
+double linearToSrgb(double v);
+long layoutSize( Layout *layout, int width, int height );
+long decodeToLayout( QoifStream *qoif, Layout *layout, unsigned char* out );
+
+int advanceProgressive( ProgressiveDecoder *dec );
+void feedProgressive( ProgressiveDecoder *dec, const unsigned char* bytes, long length );
+
+void decodeBatch( unsigned char** inputs, long* pixels, int count, PixelRGBA** outputs );
+
+#endif
@@ -0,0 +1,892 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <png.h>
+#include "qoi.h"
+#include "qoiEncoder.h"
+
+
+
+void writeChunkRGB(QoifImage *qoif, QoifChunk chunk) {
+    unsigned char* startAddr = qoif->data + qoif->bytesAdded;
+    startAddr[0] = 0xfe;
+    startAddr[1] = chunk.RGB.r;
+    startAddr[2] = chunk.RGB.g;
+    startAddr[3] = chunk.RGB.b;
+    qoif->bytesAdded += 4;
+}
+
+void writeChunkRGBA(QoifImage *qoif, QoifChunk chunk) {
+    unsigned char* startAddr = qoif->data + qoif->bytesAdded;
+    startAddr[0] = 0xff;
+    startAddr[1] = chunk.RGBA.r;
+    startAddr[2] = chunk.RGBA.g;
+    startAddr[3] = chunk.RGBA.b;
+    startAddr[4] = chunk.RGBA.a;
+    qoif->bytesAdded += 5;
+}
+
+void writeChunkINDEX(QoifImage *qoif, QoifChunk chunk) {
+    // Note: assuming index<64. Safe if not.
+    unsigned char* startAddr = qoif->data + qoif->bytesAdded;
+    startAddr[0] = chunk.INDEX.index;
+    startAddr[0] &= 0x3f;
+    qoif->bytesAdded += 1;
+}
+
+void writeChunkDIFF(QoifImage *qoif, QoifChunk chunk) {
+    // Note: assuming -2 <= dr,dg,db <= 1. Safe if not.
+    unsigned char* startAddr = qoif->data + qoif->bytesAdded;
+    startAddr[0] = 0x40;
+    startAddr[0] |= ((chunk.DIFF.dr+2) & 0x03) << 4;
+    startAddr[0] |= ((chunk.DIFF.dg+2) & 0x03) << 2;
+    startAddr[0] |= ((chunk.DIFF.db+2) & 0x03);
+    qoif->bytesAdded += 1;
+}
+
+void writeChunkLUMA(QoifImage *qoif, QoifChunk chunk) {
+    // Note: assuming -32 <= dg <= 31   and   -8 <= drdg,dbdg <= 7
+    unsigned char* startAddr = qoif->data + qoif->bytesAdded;
+    startAddr[0] = 0x80;
+    startAddr[0] |= ((chunk.LUMA.dg+32) & 0x3f);
+    startAddr[1] = 0;
+    startAddr[1] |= ((chunk.LUMA.drdg+8) & 0x0f) << 4;
+    startAddr[1] |= ((chunk.LUMA.dbdg+8) & 0x0f);
+    qoif->bytesAdded += 2;
+}
+
+void writeChunkRUN(QoifImage *qoif, QoifChunk chunk) {
+    // Note: assuming 1 <= run <= 62. Safe if not.
+    unsigned char* startAddr = qoif->data + qoif->bytesAdded;
+    startAddr[0] = 0xc0;
+    startAddr[0] |= ((chunk.RUN.run-1) & 0x3f);
+    qoif->bytesAdded += 1;
+}
+
+void writeChunk(QoifImage *qoif, QoifChunk chunk) {
+    if (chunk.type==0) writeChunkRGB(qoif, chunk);
+    else if (chunk.type==1) writeChunkRGBA(qoif, chunk);
+    else if (chunk.type==2) writeChunkINDEX(qoif, chunk);
+    else if (chunk.type==3) writeChunkDIFF(qoif, chunk);
+    else if (chunk.type==4) writeChunkLUMA(qoif, chunk);
+    else if (chunk.type==5) writeChunkRUN(qoif, chunk);
+}
+
+void writeHeader(QoifImage *qoif, int w, int h, int isRGBA, int colorspace) {
+    QoifHeader* header = (QoifHeader*) (qoif->data + qoif->bytesAdded);
+    header->magic[0] = 'q';
+    header->magic[1] = 'o';
+    header->magic[2] = 'i';
+    header->magic[3] = 'f';
+    header->width[3] = w % 256;
+    header->width[2] = (w/(1<<8)) % 256;
+    header->width[1] = (w/(1<<16)) % 256;
+    header->width[0] = (w/(1<<24)) % 256;
+    header->height[3] = h % 256;
+    header->height[2] = (h/(1<<8)) % 256;
+    header->height[1] = (h/(1<<16)) % 256;
+    header->height[0] = (h/(1<<24)) % 256;
+    header->channels = isRGBA ? 4 : 3;
+    header->colorspace = colorspace;
+    qoif->bytesAdded += 14;
+}
+
+void writeFooter(QoifImage *qoif) {
+    unsigned char* startAddr = qoif->data + qoif->bytesAdded;
+    for (int i = 0; i<7; i++) {
+        startAddr[i] = 0;
+    }
+    startAddr[7] = 1;
+    qoif->bytesAdded += 8;
+}
+
+
+PixelRGBA getFromPalette( PixelRGBA pixel, PixelRGBA* palette ) {
+    // Note: assumes minimum 64 length. UB if not.
+    int index = ( pixel.r*3 + pixel.g*5 + pixel.b*7 + pixel.a*11 ) % 64;
+    PixelRGBA p = palette[index];
+    return palette[ index ];
+}
+
+int getIndexFromPalette( PixelRGBA pixel, PixelRGBA* palette ) {
+    return ( pixel.r*3 + pixel.g*5 + pixel.b*7 + pixel.a*11 ) % 64;
+}
+
+
+void createQoifBuffer( RawImage raw, QoifImage *qoif) {
+    long size = raw.width * raw.height * raw.channels;
+    qoif->data = (unsigned char*)malloc(size*2 + 22); // minimum file size: 22
+    qoif->bytesAdded = 0;
+    if (qoif->data == NULL) {
+        err = MemAllocError;
+        return;
+    }
+}
+
+// Everything but RUN: the chunk for cur given the pixel it is predicted from
+QoifChunk decidePixelChunk( PixelRGBA cur, PixelRGBA prev, int channels, PixelRGBA palette[64]) {
+    int dr = cur.r - prev.r;
+    int dg = cur.g - prev.g;
+    int db = cur.b - prev.b;
+    int da = cur.a - prev.a;
+    PixelRGBA hashed = getFromPalette(cur, palette);
+    int hashedIndex = getIndexFromPalette(cur, palette);
+    if ( cur.r - hashed.r == 0 &&
+         cur.g - hashed.g == 0 &&
+         cur.b - hashed.b == 0 &&
+         cur.a - hashed.a == 0 ) {
+            return (QoifChunk) {
+                .type = 2,
+                .pixelsCovered = 1,
+                .INDEX = (ChunkINDEX) {
+                    .index = hashedIndex,
+                }
+            };
+    }
+    if ( -2 <= dr   &&   dr <= 1 &&
+         -2 <= dg   &&   dg <= 1 &&
+         -2 <= db   &&   db <= 1 &&
+         da == 0) {
+            return (QoifChunk) {
+                .type = 3,
+                .pixelsCovered = 1,
+                .DIFF = (ChunkDIFF) {
+                    .dr=dr, .dg=dg, .db=db
+                }
+            };
+         }
+    if ( -32 <= dg     &&   dg <= 31 &&
+         -8 <= dr-dg   &&   dr-dg <= 7 &&
+         -8 <= db-dg   &&   db-dg <= 7 &&
+         da == 0) {
+            return (QoifChunk) {
+                .type = 4,
+                .pixelsCovered = 1,
+                .LUMA = (ChunkLUMA) {
+                    .dg=dg, .drdg=dr-dg, .dbdg=db-dg
+                }
+            };
+         }
+    if (channels==4 && da!=0) {
+        return (QoifChunk) {
+                .type = 1,
+                .pixelsCovered = 1,
+                .RGBA = (ChunkRGBA) {
+                    .r=cur.r,
+                    .g=cur.g,
+                    .b=cur.b,
+                    .a=cur.a
+                }
+            };
+    }
+    return (QoifChunk) {
+                .type = 0,
+                .pixelsCovered = 1,
+                .RGB = (ChunkRGB) {
+                    .r=cur.r,
+                    .g=cur.g,
+                    .b=cur.b,
+                }
+            };
+}
+
+QoifChunk decideNextChunk( RawImage raw, PixelRGBA palette[64]) {
+    QoifChunk result;
+    // assuming pixelsProcessed != totalLengthInPixels
+    PixelRGBA* cur = ((PixelRGBA*) raw.data) + raw.pixelsProcessed;
+    PixelRGBA start = {0,0,0,255}; // initial previous pixel
+    PixelRGBA* prev;
+    if (raw.pixelsProcessed==0) {
+        prev = &start;
+    }
+    else {
+        prev = cur-1;
+    }
+    int dr = cur->r - prev->r;
+    int dg = cur->g - prev->g;
+    int db = cur->b - prev->b;
+    int da = cur->a - prev->a;
+    if (dr==0 && dg==0 && db==0 && da==0) {
+        PixelRGBA* next = cur+1;
+        while(
+            (next-cur) < 62 &&
+            (next-cur) + raw.pixelsProcessed < raw.totalLengthInPixels &&
+            cur->r == next->r &&
+            cur->g == next->g &&
+            cur->b == next->b &&
+            cur->a == next->a
+        ) {
+            next++;
+        }
+        return (QoifChunk) {
+            .type = 5,
+            .pixelsCovered = next-cur,
+            .RUN = (ChunkRUN) {
+                .run = next-cur
+            }
+        };
+        
+    }
+    return decidePixelChunk(*cur, *prev, raw.channels, palette);
+}
+
+
+// Encodes raw.pixelsProcessed .. raw.totalLengthInPixels, starting from the given palette
+void writeChunks( QoifImage *qoif, RawImage raw, PixelRGBA palette[64] ) {
+    PixelRGBA* currentPixel;
+    
+    while( raw.pixelsProcessed < raw.totalLengthInPixels ) {
+
+        currentPixel = ((PixelRGBA*) raw.data) + raw.pixelsProcessed;
+
+        QoifChunk chunk = decideNextChunk(raw, palette);
+        writeChunk(qoif, chunk);
+        addToPalette(*currentPixel, palette);
+        if (analytics) analyzePixels(analytics, *currentPixel, raw.pixelsProcessed, chunk.pixelsCovered);
+        raw.pixelsProcessed += chunk.pixelsCovered;
+        if (stats) countChunk(stats, chunk.type, chunk.pixelsCovered);
+    }
+}
+
+void writeBody( QoifImage *qoif, RawImage raw ) {
+    PixelRGBA palette[64] = {0};
+    writeChunks(qoif, raw, palette);
+}
+
+
+int isSamePixel(PixelRGBA a, PixelRGBA b) {
+    return a.r==b.r && a.g==b.g && a.b==b.b && a.a==b.a;
+}
+
+void startStreamEncoder( StreamEncoder *enc, int width, int height, int channels, int colorspace ) {
+    *enc = (StreamEncoder) { .prev = {0,0,0,255}, .channels = channels };
+    createQoifBuffer((RawImage) { .width = width, .height = height, .channels = channels }, &enc->out);
+    if (err != NoError) return;
+    writeHeader(&enc->out, width, height, channels==4, colorspace);
+}
+
+void flushRun( StreamEncoder *enc ) {
+    if (enc->run == 0) return;
+    writeChunk(&enc->out, (QoifChunk) { .type = 5, .pixelsCovered = enc->run, .RUN = { .run = enc->run } });
+    addToPalette(enc->prev, enc->palette);
+    enc->run = 0;
+}
+
+void encodePixel( StreamEncoder *enc, PixelRGBA cur ) {
+    if (isSamePixel(cur, enc->prev)) {
+        if (++enc->run == 62) flushRun(enc);
+        return;
+    }
+    flushRun(enc);
+    writeChunk(&enc->out, decidePixelChunk(cur, enc->prev, enc->channels, enc->palette));
+    addToPalette(cur, enc->palette);
+    enc->prev = cur;
+}
+
+void finishStreamEncoder( StreamEncoder *enc ) {
+    flushRun(enc);
+    writeFooter(&enc->out);
+}
+
+// Near-lossless encoder (encode --near N): red, green and blue may each be off by up to N,
+// alpha stays exact. Chunks are chosen for the pixel the decoder will reconstruct, and
+// that reconstruction, not the source pixel, is what later pixels are predicted from and
+// what goes into the palette, so errors never add up. The output is plain QOI.
+
+int isWithinTolerance( PixelRGBA a, PixelRGBA b, int tolerance ) {
+    return abs(a.r - b.r) <= tolerance &&
+           abs(a.g - b.g) <= tolerance &&
+           abs(a.b - b.b) <= tolerance &&
+           a.a == b.a;
+}
+
+int clampDelta( int value, int low, int high ) {
+    return value < low ? low : value > high ? high : value;
+}
+
+typedef unsigned char PaletteBytes __attribute__((vector_size(16))); // four palette slots
+
+// The first palette slot within tolerance of cur, -1 if there is none. Four slots are
+// compared at once, so a miss costs 16 vector compares instead of 64 scalar ones.
+int findNearSlot( PixelRGBA cur, PixelRGBA palette[64], int tolerance ) {
+    PaletteBytes target, limit;
+    for (int k = 0; k < 16; k += 4) {
+        memcpy((unsigned char*) &target + k, &cur, 4);
+        limit[k] = limit[k+1] = limit[k+2] = tolerance > 255 ? 255 : tolerance;
+        limit[k+3] = 0; // alpha stays exact
+    }
+    for (int i = 0; i < 64; i += 4) {
+        PaletteBytes slots;
+        memcpy(&slots, palette + i, 16);
+        PaletteBytes above = (PaletteBytes) (slots > target);
+        PaletteBytes distance = ((slots - target) & above) | ((target - slots) & ~above);
+        PaletteBytes outside = (PaletteBytes) (distance > limit);
+        uint32_t missed[4];
+        memcpy(missed, &outside, 16);
+        for (int k = 0; k < 4; k++) {
+            if (missed[k] == 0) return i + k;
+        }
+    }
+    return -1;
+}
+
+// Picks a chunk for cur and stores in recon what the decoder will make of it
+QoifChunk decideNearChunk( PixelRGBA cur, PixelRGBA prev, int channels, int tolerance, PixelRGBA palette[64], PixelRGBA *recon ) {
+    int hashedIndex = getIndexFromPalette(cur, palette);
+    int index = isWithinTolerance(cur, palette[hashedIndex], tolerance) ? hashedIndex : findNearSlot(cur, palette, tolerance);
+    if (index >= 0) {
+        *recon = palette[index];
+        return (QoifChunk) { .type = 2, .pixelsCovered = 1, .INDEX = { .index = index } };
+    }
+
+    if (cur.a == prev.a) {
+        int dr = clampDelta(cur.r - prev.r, -2, 1);
+        int dg = clampDelta(cur.g - prev.g, -2, 1);
+        int db = clampDelta(cur.b - prev.b, -2, 1);
+        PixelRGBA p = { prev.r + dr, prev.g + dg, prev.b + db, prev.a }; // wraps like the decoder
+        if (isWithinTolerance(cur, p, tolerance)) {
+            *recon = p;
+            return (QoifChunk) { .type = 3, .pixelsCovered = 1, .DIFF = { .dr = dr, .dg = dg, .db = db } };
+        }
+
+        dg = clampDelta(cur.g - prev.g, -32, 31);
+        int drdg = clampDelta(cur.r - prev.r - dg, -8, 7);
+        int dbdg = clampDelta(cur.b - prev.b - dg, -8, 7);
+        p = (PixelRGBA) { prev.r + dg + drdg, prev.g + dg, prev.b + dg + dbdg, prev.a };
+        if (isWithinTolerance(cur, p, tolerance)) {
+            *recon = p;
+            return (QoifChunk) { .type = 4, .pixelsCovered = 1, .LUMA = { .dg = dg, .drdg = drdg, .dbdg = dbdg } };
+        }
+    }
+
+    *recon = cur;
+    return decidePixelChunk(cur, prev, channels, palette);
+}
+
+void writeBodyNearLossless( QoifImage *qoif, RawImage raw, int tolerance ) {
+    PixelRGBA palette[64] = {0};
+    PixelRGBA prev = {0,0,0,255};
+    PixelRGBA* pixels = (PixelRGBA*) raw.data;
+
+    while( raw.pixelsProcessed < raw.totalLengthInPixels ) {
+        PixelRGBA cur = pixels[raw.pixelsProcessed];
+        QoifChunk chunk;
+        if (isWithinTolerance(cur, prev, tolerance)) {
+            int run = 1;
+            while (run < 62 && raw.pixelsProcessed + run < raw.totalLengthInPixels &&
+                   isWithinTolerance(pixels[raw.pixelsProcessed + run], prev, tolerance)) {
+                run++;
+            }
+            chunk = (QoifChunk) { .type = 5, .pixelsCovered = run, .RUN = { .run = run } };
+        }
+        else {
+            chunk = decideNearChunk(cur, prev, raw.channels, tolerance, palette, &prev);
+        }
+        writeChunk(qoif, chunk);
+        addToPalette(prev, palette);
+        if (analytics) analyzePixels(analytics, prev, raw.pixelsProcessed, chunk.pixelsCovered); // what decoders will see
+        raw.pixelsProcessed += chunk.pixelsCovered;
+        if (stats) countChunk(stats, chunk.type, chunk.pixelsCovered);
+    }
+}
+
+
+// Parallel encoder: produces exactly the bytes of writeBody. Stripes only start where a
+// pixel differs from the one before it, so no RUN chunk can cross a stripe boundary.
+// Each stripe then starts from the state the serial encoder would have there: the
+// previous pixel is simply the raw pixel before the stripe, and every palette slot holds
+// the last earlier pixel that hashed to it, which a backward scan finds.
+
+typedef struct {
+    RawImage raw;      // pixelsProcessed = first pixel, totalLengthInPixels = end of stripe
+    QoifImage out;
+} Stripe;
+
+void reconstructPalette( RawImage raw, PixelRGBA palette[64] ) {
+    PixelRGBA* pixels = (PixelRGBA*) raw.data;
+    char filled[64] = {0};
+    int slotsFilled = 0;
+    memset(palette, 0, 64 * sizeof(PixelRGBA));
+    for (long i = raw.pixelsProcessed-1; i >= 0 && slotsFilled < 64; i--) {
+        int index = getIndexFromPalette(pixels[i], palette);
+        if (filled[index]) continue;
+        filled[index] = 1;
+        palette[index] = pixels[i];
+        slotsFilled++;
+    }
+}
+
+void* encodeStripe(void* arg) {
+    Stripe* stripe = arg;
+    PixelRGBA palette[64];
+    reconstructPalette(stripe->raw, palette);
+    writeChunks(&stripe->out, stripe->raw, palette);
+    return NULL;
+}
+
+void writeBodyParallel( QoifImage *qoif, RawImage raw, int threads ) {
+    long minimumStripe = 1<<15; // pixels, below this threads cost more than they save
+    if (threads > raw.totalLengthInPixels / minimumStripe) threads = raw.totalLengthInPixels / minimumStripe;
+    if (threads <= 1) {
+        writeBody(qoif, raw);
+        return;
+    }
+
+    PixelRGBA* pixels = (PixelRGBA*) raw.data;
+    Stripe stripes[threads];
+    int stripeCount = 0;
+    long start = 0;
+    for (int i = 1; i <= threads; i++) {
+        long end = i == threads ? raw.totalLengthInPixels : raw.totalLengthInPixels / threads * i;
+        if (end <= start) continue;
+        while (end < raw.totalLengthInPixels && memcmp(&pixels[end], &pixels[end-1], sizeof(PixelRGBA)) == 0) end++;
+
+        Stripe* stripe = &stripes[stripeCount];
+        stripe->raw = raw;
+        stripe->raw.pixelsProcessed = start;
+        stripe->raw.totalLengthInPixels = end;
+        stripe->out.data = malloc((end-start)*5);
+        stripe->out.bytesAdded = 0;
+        if (!stripe->out.data) {
+            for (int j = 0; j < stripeCount; j++) free(stripes[j].out.data);
+            writeBody(qoif, raw);
+            return;
+        }
+        stripeCount++;
+        start = end;
+    }
+
+    pthread_t workers[stripeCount];
+    for (int i = 1; i < stripeCount; i++) {
+        pthread_create(&workers[i], NULL, encodeStripe, &stripes[i]);
+    }
+    encodeStripe(&stripes[0]);
+    for (int i = 1; i < stripeCount; i++) {
+        pthread_join(workers[i], NULL);
+    }
+
+    for (int i = 0; i < stripeCount; i++) {
+        memcpy(qoif->data + qoif->bytesAdded, stripes[i].out.data, stripes[i].out.bytesAdded);
+        qoif->bytesAdded += stripes[i].out.bytesAdded;
+        free(stripes[i].out.data);
+    }
+}
+
+
+void readPngSource(png_structp png, png_bytep out, png_size_t count) {
+    PngSource* source = png_get_io_ptr(png);
+    if (count > (png_size_t) (source->length - source->offset)) {
+        png_error(png, "Truncated PNG data");
+    }
+    memcpy(out, source->data + source->offset, count);
+    source->offset += count;
+}
+
+// Set by --colorspace, otherwise the PNG decides
+int colorspaceOverride = -1;
+
+// QOI colorspace of a PNG: linear (1) if its gamma is 1.0, sRGB (0) if it says so or says nothing
+int pngColorspace(png_structp png, png_infop info) {
+    if (colorspaceOverride >= 0) return colorspaceOverride;
+    if (png_get_valid(png, info, PNG_INFO_sRGB)) return 0;
+    double gamma;
+    if (png_get_gAMA(png, info, &gamma) && gamma > 0.9 && gamma < 1.1) return 1;
+    return 0;
+}
+
+// Sets up libpng to deliver 8-bit RGBA whatever the file holds
+void expandToRGBA(png_structp png, png_infop info) {
+    png_byte color_type = png_get_color_type(png, info);
+    png_byte bit_depth = png_get_bit_depth(png, info);
+
+    // Adjustments based on color type
+    if (bit_depth == 16) {
+        png_set_strip_16(png);  // Reduce 16-bit images to 8-bit
+    }
+    if (color_type == PNG_COLOR_TYPE_PALETTE) {
+        png_set_palette_to_rgb(png);  // Convert palette to RGB
+    }
+    if (color_type == PNG_COLOR_TYPE_GRAY && bit_depth < 8) {
+        png_set_expand_gray_1_2_4_to_8(png);  // Expand grayscale
+    }
+    if (png_get_valid(png, info, PNG_INFO_tRNS)) {
+        png_set_tRNS_to_alpha(png);  // Add alpha if transparency info is present
+    }
+    if (color_type == PNG_COLOR_TYPE_RGB || color_type == PNG_COLOR_TYPE_GRAY || color_type == PNG_COLOR_TYPE_PALETTE) {
+        png_set_filler(png, 0xFF, PNG_FILLER_AFTER);  // Add alpha channel if needed
+    }
+}
+
+// With a buffer the pixels go there, and it is grown when the image doesn't fit, so a
+// caller going through many images keeps one allocation. Without one they get their own.
+void readPngInto(FILE* fp, PngSource *source, RawImage *image, unsigned char** buffer, long* capacity) {
+    // Create and initialize png_struct
+    png_structp png = png_create_read_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+    if (!png) {
+        err = PngError;
+        return;
+    }
+
+    // Create and initialize png_info
+    png_infop info = png_create_info_struct(png);
+    if (!info) {
+        png_destroy_read_struct(&png, NULL, NULL);
+        err = PngError;
+        return;
+    }
+
+    if (setjmp(png_jmpbuf(png))) {
+        png_destroy_read_struct(&png, &info, NULL);
+        err = PngError;
+        return;
+    }
+
+    if (fp) png_init_io(png, fp);
+    else png_set_read_fn(png, source, readPngSource);
+    png_read_info(png, info);
+
+    // Get image info
+    int width = png_get_image_width(png, info);
+    int height = png_get_image_height(png, info);
+    int colorspace = pngColorspace(png, info);
+    expandToRGBA(png, info);
+
+    png_read_update_info(png, info);
+
+    int channels = png_get_channels(png, info);  // Get the number of channels
+
+    // Allocate memory for image data
+    long size = (long) width * height * channels;
+    unsigned char* data = buffer && *capacity >= size ? *buffer : (unsigned char*)malloc(size);
+    if (!data) {
+        png_destroy_read_struct(&png, &info, NULL);
+        err = MemAllocError;
+        return;
+    }
+    if (buffer && data != *buffer) {
+        free(*buffer);
+        *buffer = data;
+        *capacity = size;
+    }
+
+    png_bytep* row_pointers = (png_bytep*)malloc(sizeof(png_bytep) * height);
+    for (int y = 0; y < height; y++) {
+        row_pointers[y] = data + y * width * channels;
+    }
+
+    // Read the image
+    png_read_image(png, row_pointers);
+
+    // Cleanup
+    png_destroy_read_struct(&png, &info, NULL);
+    free(row_pointers);
+
+    // Store image data
+    image->data = data;
+    image->width = width;
+    image->height = height;
+    image->channels = channels;
+    image->pixelsProcessed = 0;
+    image->totalLengthInPixels = width*height;
+    image->colorspace = colorspace;
+    err = NoError;
+}
+
+void readPng(FILE* fp, PngSource *source, RawImage *image) {
+    readPngInto(fp, source, image, NULL, NULL);
+}
+
+void readPngFile(const char* filename, RawImage *image) {
+    FILE* fp = fopen(filename, "rb");
+    if (!fp) {
+        err = OpenFileError;
+        return;
+    }
+    readPng(fp, NULL, image);
+    fclose(fp);
+}
+
+void readPngFileInto(const char* filename, RawImage *image, unsigned char** buffer, long* capacity) {
+    FILE* fp = fopen(filename, "rb");
+    if (!fp) {
+        err = OpenFileError;
+        return;
+    }
+    readPngInto(fp, NULL, image, buffer, capacity);
+    fclose(fp);
+}
+
+void readPngBuffer(unsigned char* data, long length, RawImage *image) {
+    PngSource source = { data, length, 0 };
+    readPng(NULL, &source, image);
+}
+
+
+// One Adam7 pass of raw as a complete QOI stream, see encode --progressive
+void encodePass( RawImage raw, int pass, QoifImage *qoif ) {
+    const int* p = adam7[pass];
+    RawImage gathered = raw;
+    gathered.width = adam7Size(raw.width, p[0], p[2]);
+    gathered.height = adam7Size(raw.height, p[1], p[3]);
+    gathered.totalLengthInPixels = (long) gathered.width * gathered.height;
+    gathered.pixelsProcessed = 0;
+    gathered.data = malloc(gathered.totalLengthInPixels * sizeof(PixelRGBA) + 1);
+    qoif->data = NULL;
+    if (gathered.data) createQoifBuffer(gathered, qoif);
+    if (!gathered.data || !qoif->data) {
+        free(gathered.data);
+        err = MemAllocError;
+        return;
+    }
+
+    PixelRGBA* pixels = (PixelRGBA*) raw.data;
+    PixelRGBA* next = (PixelRGBA*) gathered.data;
+    for (int y = 0; y < gathered.height; y++) {
+        PixelRGBA* row = pixels + (long) (p[1] + y*p[3]) * raw.width;
+        for (int x = 0; x < gathered.width; x++) *next++ = row[p[0] + x*p[2]];
+    }
+    writeHeader(qoif, gathered.width, gathered.height, raw.channels==4, raw.colorspace);
+    writeBody(qoif, gathered);
+    writeFooter(qoif);
+    free(gathered.data);
+    err = NoError;
+}
+
+
+// Batch encoder (encode --batch) for piles of tiny images such as icons and tiles.
+// encodeBatch runs BATCH_LANES images in step, one pixel of each at a time, with the
+// per-pixel work done on vectors that hold one value per lane: the comparisons, hashes
+// and differences, and the choice of chunk, which is made with masks instead of branches.
+// Only the palette and the output, different memory for every lane, are handled lane by
+// lane. Once the queue runs dry, the remaining images are finished by a StreamEncoder.
+
+// Largest possible QOI stream of an image: an RGBA chunk for every pixel
+long qoifBound( RawImage raw ) {
+    return raw.totalLengthInPixels * 5 + 22;
+}
+
+typedef struct {
+    uint32_t palette[BATCH_LANES][65];   // slot 64 takes the stores writeBody wouldn't make
+    PixelRGBA* next[BATCH_LANES];
+    unsigned char* out[BATCH_LANES];
+    long left[BATCH_LANES];
+    int image[BATCH_LANES];
+    Lanes prev;
+    Lanes prevIndex;
+    Lanes run;
+    Lanes alpha;   // set where the image has 4 channels
+} BatchLanes;
+
+static inline __attribute__((always_inline)) void encodeLanes( BatchLanes *b ) {
+    Lanes cur, hashed;
+    // unrolled, so the lanes' values go straight between registers and vectors
+    #pragma GCC unroll 8
+    for (int l = 0; l < BATCH_LANES; l++) memcpy(&cur[l], b->next[l]++, 4);
+    Lanes same = (Lanes) (cur == b->prev);
+
+    // the RUN chunk goes out when the run is full or the pixel breaks it, and then puts
+    // prev into the palette, before cur is looked up
+    Lanes run = b->run - same;
+    Lanes flush = (same & (Lanes) (run == 62)) | (~same & (Lanes) (run > 0));
+    Lanes runByte = 0xc0 | ((run - 1) & 63);
+    Lanes prevSlot = pickLanes(flush, b->prevIndex, (Lanes) {0} + 64);
+    Lanes index = hashLanes(cur);
+    #pragma GCC unroll 8
+    for (int l = 0; l < BATCH_LANES; l++) {
+        b->out[l][0] = runByte[l];
+        b->out[l] -= (int) flush[l];
+        b->palette[l][prevSlot[l]] = b->prev[l];
+        hashed[l] = b->palette[l][index[l]];
+    }
+    b->run = run & same & (Lanes) (run != 62);
+
+    // differences wrap around, so ((d + k) & ~m) == 0 checks -k <= d < m+1-k
+    Lanes dr = (cur & 255) - (b->prev & 255);
+    Lanes dg = (cur >> 8 & 255) - (b->prev >> 8 & 255);
+    Lanes db = (cur >> 16 & 255) - (b->prev >> 16 & 255);
+    Lanes sameAlpha = (Lanes) ((cur >> 24) == (b->prev >> 24));
+    Lanes hit = (Lanes) (hashed == cur);
+    Lanes diff = sameAlpha & (Lanes) ((((dr+2) | (dg+2) | (db+2)) & ~3) == 0);
+    Lanes luma = sameAlpha & (Lanes) ((((dg+32) & ~63) | (((dr-dg+8) | (db-dg+8)) & ~15)) == 0);
+    Lanes rgba = ~sameAlpha & b->alpha;
+
+    Lanes chunk = cur << 8 | 0xfe | (rgba & 1);
+    chunk = pickLanes(luma, 0x80 | (dg+32) | ((dr-dg+8) << 4 | (db-dg+8)) << 8, chunk);
+    chunk = pickLanes(diff, 0x40 | (dr+2) << 4 | (dg+2) << 2 | (db+2), chunk);
+    chunk = pickLanes(hit, index, chunk);
+    Lanes length = pickLanes(hit | diff, (Lanes) {0} + 1, pickLanes(luma, (Lanes) {0} + 2, 4 - rgba)) & ~same;
+    Lanes curSlot = pickLanes(same, (Lanes) {0} + 64, index);
+    #pragma GCC unroll 8
+    for (int l = 0; l < BATCH_LANES; l++) {
+        // the end marker after the last chunk leaves room for all 5 bytes
+        memcpy(b->out[l], &chunk[l], 4);
+        b->out[l][4] = cur[l] >> 24;
+        b->out[l] += length[l];
+        b->palette[l][curSlot[l]] = cur[l];
+    }
+    b->prev = cur;
+    b->prevIndex = index;
+}
+
+void finishBatchLane( BatchLanes *b, int l, unsigned char* arena, long* offsets, QoifImage* outputs ) {
+    unsigned char* start = arena + offsets[b->image[l]];
+    StreamEncoder enc = { .out = { start, b->out[l] - start }, .run = b->run[l], .channels = b->alpha[l] ? 4 : 3 };
+    memcpy(&enc.prev, &b->prev[l], 4);
+    memcpy(enc.palette, b->palette[l], sizeof(enc.palette));
+    for (long i = 0; i < b->left[l]; i++) encodePixel(&enc, *b->next[l]++);
+    finishStreamEncoder(&enc);
+    outputs[b->image[l]] = enc.out;
+}
+
+// Encodes count images, image i into arena + offsets[i], and leaves the streams in
+// outputs. Each is byte for byte what writeBody makes of the image.
+void encodeBatch( RawImage* images, int count, unsigned char* arena, long* offsets, QoifImage* outputs ) {
+    BatchLanes b;
+    int queued = 0;
+    int busy = 0;
+    for (int l = 0; l < BATCH_LANES; l++) b.left[l] = 0;
+
+    while (1) {
+        // idle lanes take the next images, empty ones are finished right here
+        for (int l = 0; l < BATCH_LANES; l++) {
+            while (b.left[l] == 0 && queued < count) {
+                RawImage* raw = &images[queued];
+                QoifImage qoif = { arena + offsets[queued], 0 };
+                writeHeader(&qoif, raw->width, raw->height, raw->channels==4, raw->colorspace);
+                if (raw->totalLengthInPixels == 0) {
+                    writeFooter(&qoif);
+                    outputs[queued++] = qoif;
+                    continue;
+                }
+                memset(b.palette[l], 0, sizeof(b.palette[l]));
+                b.next[l] = (PixelRGBA*) raw->data;
+                b.out[l] = qoif.data + qoif.bytesAdded;
+                b.left[l] = raw->totalLengthInPixels;
+                b.image[l] = queued++;
+                b.prev[l] = 0xff000000;
+                b.prevIndex[l] = 255*11 % 64;
+                b.run[l] = 0;
+                b.alpha[l] = raw->channels == 4 ? -1 : 0;
+                busy++;
+            }
+        }
+        if (busy < BATCH_LANES) break;
+
+        // all lanes go the same number of steps, until the shortest image is done
+        long steps = b.left[0];
+        for (int l = 1; l < BATCH_LANES; l++) if (b.left[l] < steps) steps = b.left[l];
+        for (long s = 0; s < steps; s++) encodeLanes(&b);
+        for (int l = 0; l < BATCH_LANES; l++) {
+            b.left[l] -= steps;
+            if (b.left[l] > 0) continue;
+            finishBatchLane(&b, l, arena, offsets, outputs);
+            busy--;
+        }
+    }
+
+    for (int l = 0; l < BATCH_LANES; l++) {
+        if (b.left[l] > 0) finishBatchLane(&b, l, arena, offsets, outputs);
+    }
+}
+
+// LZ back end (encode --lz, "qoiz"): the finished QOI stream, header and end marker
+// included, cut into independent blocks of at most 64 KB and compressed LZ4 style.
+//   header   magic "qoiz", length of the QOI stream (BE)
+//   blocks   raw length, packed length (both BE), then the packed bytes;
+//            a block whose packed length equals its raw length is stored as is
+// A sequence is a token (literal count << 4 | match length - 4, 15 = more bytes follow),
+// the literals, then a 2-byte little-endian match offset. The last sequence of a block
+// has literals only.
+
+#define LZ_HASH_BITS 12
+
+uint32_t readLE32(const unsigned char* src) {
+    uint32_t value;
+    memcpy(&value, src, 4);
+    return value;
+}
+
+unsigned char* writeLzLength(unsigned char* out, long length) {
+    for (; length >= 255; length -= 255) *out++ = 255;
+    *out++ = length;
+    return out;
+}
+
+unsigned char* writeLzSequence(unsigned char* out, const unsigned char* literals, long literalCount, long offset, long matchLength) {
+    unsigned char* token = out++;
+    *token = (literalCount < 15 ? literalCount : 15) << 4;
+    if (literalCount >= 15) out = writeLzLength(out, literalCount - 15);
+    memcpy(out, literals, literalCount);
+    out += literalCount;
+    if (matchLength == 0) return out;
+
+    *out++ = offset;
+    *out++ = offset >> 8;
+    *token |= matchLength - 4 < 15 ? matchLength - 4 : 15;
+    if (matchLength - 4 >= 15) out = writeLzLength(out, matchLength - 4 - 15);
+    return out;
+}
+
+// out needs room for length + length/255 + 16 bytes
+long compressLzBlock(const unsigned char* in, long length, unsigned char* out) {
+    uint32_t table[1 << LZ_HASH_BITS] = {0}; // position + 1 of the last 4 bytes with that hash
+    unsigned char* o = out;
+    long anchor = 0;
+    long pos = 0;
+
+    // like LZ4, the last 12 bytes never start a match and the last 5 are always literals
+    while (pos + 12 < length) {
+        uint32_t sequence = readLE32(in + pos);
+        uint32_t hash = (sequence * 2654435761u) >> (32 - LZ_HASH_BITS);
+        long candidate = (long) table[hash] - 1;
+        table[hash] = pos + 1;
+        if (candidate < 0 || pos - candidate > 65535 || readLE32(in + candidate) != sequence) {
+            pos++;
+            continue;
+        }
+        long matchLength = 4;
+        while (pos + matchLength < length - 5 && in[candidate + matchLength] == in[pos + matchLength]) matchLength++;
+        o = writeLzSequence(o, in + anchor, pos - anchor, pos - candidate, matchLength);
+        pos += matchLength;
+        anchor = pos;
+    }
+    o = writeLzSequence(o, in + anchor, length - anchor, 0, 0);
+    return o - out;
+}
+
+// Replaces a finished QOI stream with its qoiz container. A stream the container doesn't
+// shrink (noisy photos mostly) stays plain QOI, which every reader of qoiz takes as well.
+void compressQoif( QoifImage *qoif ) {
+    long blocks = (qoif->bytesAdded + LZ_BLOCK - 1) / LZ_BLOCK;
+    unsigned char* packed = malloc(8 + blocks * (8 + LZ_BLOCK + LZ_BLOCK/255 + 16));
+    if (!packed) {
+        err = MemAllocError;
+        return;
+    }
+    memcpy(packed, "qoiz", 4);
+    putBE32(packed + 4, qoif->bytesAdded);
+
+    long length = 8;
+    for (long start = 0; start < qoif->bytesAdded; start += LZ_BLOCK) {
+        long rawLength = qoif->bytesAdded - start < LZ_BLOCK ? qoif->bytesAdded - start : LZ_BLOCK;
+        unsigned char* block = packed + length;
+        long packedLength = compressLzBlock(qoif->data + start, rawLength, block + 8);
+        if (packedLength >= rawLength) {
+            memcpy(block + 8, qoif->data + start, rawLength);
+            packedLength = rawLength;
+        }
+        putBE32(block, rawLength);
+        putBE32(block + 4, packedLength);
+        length += 8 + packedLength;
+    }
+
+    if (length >= qoif->bytesAdded) {
+        free(packed);
+        return;
+    }
+    free(qoif->data);
+    qoif->data = packed;
+    qoif->bytesAdded = length;
+}
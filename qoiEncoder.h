@@ -0,0 +1,126 @@
+// The encoder core: PNG input and everything that produces QOI, shared by encode and verify
+#ifndef QOI_ENCODER_H
+#define QOI_ENCODER_H
+
+#include <stdio.h>
+#include <png.h>
+#include "qoi.h"
+
+
+
+
+typedef struct {
+    char magic[4]; // magic bytes "qoif"
+    char width[4]; // image width in pixels (BE)
+    char height[4]; // image height in pixels (BE)
+    uint8_t channels; // 3 = RGB, 4 = RGBA
+    uint8_t colorspace; // 0 = sRGB with linear alpha
+    // 1 = all channels linear
+} QoifHeader;
+
+
+typedef struct {
+    unsigned char* data;
+    long bytesAdded;
+} QoifImage;
+
+typedef struct {
+    unsigned char* data;  // Pointer to RGB or RGBA data
+    int width;
+    int height;
+    int channels;         // 3 for RGB, 4 for RGBA
+    long totalLengthInPixels;
+    long pixelsProcessed; // 0
+    int colorspace;       // header byte, as found in the PNG or set by --colorspace
+} RawImage;
+
+typedef struct {
+    unsigned char r, g, b;
+} ChunkRGB;
+
+typedef struct {
+    unsigned char r, g, b, a;
+} ChunkRGBA;
+
+typedef struct {
+    char index;
+} ChunkINDEX;
+
+typedef struct {
+    signed char dr, dg, db;
+} ChunkDIFF;
+
+typedef struct {
+    signed char dg, drdg, dbdg;
+} ChunkLUMA;
+
+typedef struct {
+    char run;
+} ChunkRUN;
+
+typedef struct {
+    int type; // 0=RGB, 1=RGBA, 2=INDEX, 3=DIFF, 4=LUMA, 5=RUN
+    int pixelsCovered; // 1 for all except RUN
+    union {
+        ChunkRGB RGB;
+        ChunkRGBA RGBA;
+        ChunkINDEX INDEX;
+        ChunkDIFF DIFF;
+        ChunkLUMA LUMA;
+        ChunkRUN RUN;
+    };
+} QoifChunk;
+
+// Pixel-at-a-time form of writeBody for producers that hand over pixels as they go.
+// The output is byte for byte what writeBody makes of the same pixels.
+typedef struct {
+    QoifImage out;
+    PixelRGBA palette[64];
+    PixelRGBA prev;
+    int run;       // pixels equal to prev not written yet
+    int channels;
+} StreamEncoder;
+
+typedef struct {
+    unsigned char* data;
+    long length;
+    long offset;
+} PngSource;
+
+
+void writeChunk(QoifImage *qoif, QoifChunk chunk);
+void writeHeader(QoifImage *qoif, int w, int h, int isRGBA, int colorspace);
+void writeFooter(QoifImage *qoif);
+int getIndexFromPalette( PixelRGBA pixel, PixelRGBA* palette );
+void createQoifBuffer( RawImage raw, QoifImage *qoif);
+QoifChunk decidePixelChunk( PixelRGBA cur, PixelRGBA prev, int channels, PixelRGBA palette[64]);
+int isSamePixel(PixelRGBA a, PixelRGBA b);
+int isWithinTolerance( PixelRGBA a, PixelRGBA b, int tolerance );
+
+// Serial, near-lossless and parallel bodies: the chunks between header and end marker
+void writeBody( QoifImage *qoif, RawImage raw );
+void writeBodyNearLossless( QoifImage *qoif, RawImage raw, int tolerance );
+void writeBodyParallel( QoifImage *qoif, RawImage raw, int threads );
+
+void startStreamEncoder( StreamEncoder *enc, int width, int height, int channels, int colorspace );
+void encodePixel( StreamEncoder *enc, PixelRGBA cur );
+void finishStreamEncoder( StreamEncoder *enc );
+
+// PNG input, always 8-bit RGBA
+extern int colorspaceOverride;
+int pngColorspace(png_structp png, png_infop info);
+void expandToRGBA(png_structp png, png_infop info);
+void readPng(FILE* fp, PngSource *source, RawImage *image);
+void readPngInto(FILE* fp, PngSource *source, RawImage *image, unsigned char** buffer, long* capacity);
+void readPngFile(const char* filename, RawImage *image);
+void readPngFileInto(const char* filename, RawImage *image, unsigned char** buffer, long* capacity);
+void readPngBuffer(unsigned char* data, long length, RawImage *image);
+
+void encodePass( RawImage raw, int pass, QoifImage *qoif );
+
+long qoifBound( RawImage raw );
+void encodeBatch( RawImage* images, int count, unsigned char* arena, long* offsets, QoifImage* outputs );
+
+void compressQoif( QoifImage *qoif );
+
+#endif
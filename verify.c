@@ -0,0 +1,756 @@
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#include <sys/stat.h>
+#include "qoi.h"
+#include "qoiEncoder.h"
+#include "qoiDecoder.h"
+
+// In-memory round trips through the encoder and decoder cores that encode and decode
+// are built from: every PNG is encoded and decoded in memory with writeBody and
+// decodeBody, and the pixels are compared with the PNG's. --all also puts it through the
+// other encoders (striped, near-lossless, progressive, batch lanes, qoiz) and ways of
+// decoding (validation, layouts and conversions, progressive, batch lanes).
+
+#define VERIFY_NEAR 4      // tolerance of the near-lossless check
+#define VERIFY_STRIPES 4   // threads of the parallel encoder check
+
+typedef struct {
+    FileList* files;
+    long nextFile;       // shared work counter
+    long mismatches;
+    long failures;
+    long pixels;
+    long qoifBytes;
+    int all;             // every check, not only the round trip
+    pthread_mutex_t lock;
+} VerifyJob;
+
+// Reports that a check couldn't run, returns 2
+int checkFailed(const char* filename, const char* check) {
+    printf("ERROR %s, %s: %s\n", filename, check, errorMessages[err]);
+    return 2;
+}
+
+// 0 if the pixels are the first count of raw, colour channels within tolerance
+int comparePixels(const char* filename, const char* check, RawImage *raw, PixelRGBA* decoded, long count, int tolerance) {
+    PixelRGBA* pixels = (PixelRGBA*) raw->data;
+    for (long i = 0; i < count; i++) {
+        PixelRGBA p = pixels[i];
+        PixelRGBA q = decoded[i];
+        if (isWithinTolerance(p, q, tolerance)) continue;
+        printf("MISMATCH %s, %s: first difference at %ld, %ld: (%hhu,%hhu,%hhu,%hhu) vs (%hhu,%hhu,%hhu,%hhu)\n",
+            filename, check, i % raw->width, i / raw->width,
+            p.r, p.g, p.b, p.a, q.r, q.g, q.b, q.a);
+        return 1;
+    }
+    return 0;
+}
+
+// Header, body from the given encoder (0 = serial, 1 = parallel, 2 = near-lossless), end marker
+void encodeImage(RawImage *raw, int encoder, QoifImage *qoif) {
+    createQoifBuffer(*raw, qoif);
+    if (err != NoError) return;
+    writeHeader(qoif, raw->width, raw->height, raw->channels==4, raw->colorspace);
+    if (encoder == 0) writeBody(qoif, *raw);
+    else if (encoder == 1) writeBodyParallel(qoif, *raw, VERIFY_STRIPES);
+    else writeBodyNearLossless(qoif, *raw, VERIFY_NEAR);
+    writeFooter(qoif);
+}
+
+// Decodes a QOI or qoiz stream with the chunk loop and compares it with raw
+int checkStream(const char* filename, const char* check, QoifImage *qoif, RawImage *raw, int tolerance) {
+    QoifStream stream;
+    PixelBuffer decoded;
+    openQoifBuffer(qoif->data, qoif->bytesAdded, &stream, &decoded);
+    if (err != NoError) return checkFailed(filename, check);
+    decodeBody(&stream, &decoded);
+
+    int result = 0;
+    if (err != NoError) {
+        result = checkFailed(filename, check);
+    }
+    else if (decoded.pixelsAdded != raw->totalLengthInPixels) {
+        printf("MISMATCH %s, %s: decoded %ld of %ld pixels\n", filename, check, decoded.pixelsAdded, raw->totalLengthInPixels);
+        result = 1;
+    }
+    else {
+        result = comparePixels(filename, check, raw, decoded.data, raw->totalLengthInPixels, tolerance);
+    }
+    free(decoded.data);
+    return result;
+}
+
+// What decodeToLayout should make of px, worked out on its own
+PixelRGBA convertedPixel(Layout *layout, unsigned char curve[256], PixelRGBA px) {
+    unsigned char c[4] = { curve[px.r], curve[px.g], curve[px.b], px.a };
+    if (layout->premultiply) {
+        for (int k = 0; k < 3; k++) c[k] = (c[k] * px.a + 127) / 255;
+    }
+    return (PixelRGBA) { c[layout->order[0]], c[layout->order[1]], c[layout->order[2]], c[layout->order[3]] };
+}
+
+// CHW value of channel c of px, worked out in double
+double convertedValue(Layout *layout, double transfer[256], PixelRGBA px, int c) {
+    unsigned char* bytes = (unsigned char*) &px;
+    int from = layout->order[c];
+    if (from == 3) return px.a * layout->scale[c] + layout->bias[c];
+    double v = layout->colorspace >= 0 ? transfer[bytes[from]] : bytes[from];
+    if (layout->premultiply) v = v * px.a / 255;
+    return v * layout->scale[c] + layout->bias[c];
+}
+
+// decodeToLayout into plain and converted interleaved pixels, and into plain and
+// converted CHW floats
+int checkLayouts(const char* filename, QoifImage *qoif, RawImage *raw) {
+    Layout layouts[4] = {
+        { .format = 0, .colorspace = -1, .order = {0,1,2,3} },
+        { .format = 0, .colorspace = !raw->colorspace, .premultiply = 1, .order = {2,1,0,3} },
+        { .format = 2, .channels = 4, .colorspace = -1, .order = {0,1,2,3},
+          .scale = {2/255.f, 2/255.f, 2/255.f, 1/255.f}, .bias = {-1, -1, -1, 0} },
+        { .format = 2, .channels = 4, .colorspace = !raw->colorspace, .premultiply = 1, .order = {2,1,0,3},
+          .scale = {1/255.f, 1/255.f, 1/255.f, 1/255.f}, .bias = {-0.5f, 0, 0, 0} },
+    };
+    const char* checks[4] = { "layout", "layout with conversion", "layout chw", "layout chw with conversion" };
+    unsigned char curve[256];
+    double transfer[256];
+    for (int v = 0; v < 256; v++) {
+        double x = raw->colorspace == 0 ? srgbToLinear(v / 255.0) : linearToSrgb(v / 255.0);
+        curve[v] = (unsigned char) (x * 255 + 0.5);
+        transfer[v] = x * 255;
+    }
+
+    long pixels = raw->totalLengthInPixels;
+    PixelRGBA* source = (PixelRGBA*) raw->data;
+    for (int k = 0; k < 4; k++) {
+        Layout* layout = &layouts[k];
+        layout->pitch = (long) raw->width * 4;
+        QoifStream stream;
+        openQoifBuffer(qoif->data, qoif->bytesAdded, &stream, NULL);
+        unsigned char* out = err == NoError ? malloc(layoutSize(layout, raw->width, raw->height)) : NULL;
+        if (!out) {
+            if (err == NoError) err = MemAllocError;
+            return checkFailed(filename, checks[k]);
+        }
+        long written = decodeToLayout(&stream, layout, out);
+
+        int result = 0;
+        if (written != pixels) {
+            printf("MISMATCH %s, %s: decoded %ld of %ld pixels\n", filename, checks[k], written, pixels);
+            result = 1;
+        }
+        else if (layout->format == 0) {
+            PixelRGBA* decoded = (PixelRGBA*) out;
+            for (long i = 0; i < pixels && !result; i++) {
+                PixelRGBA want = k == 0 ? source[i] : convertedPixel(layout, curve, source[i]);
+                if (memcmp(&want, &decoded[i], 4) == 0) continue;
+                printf("MISMATCH %s, %s: first difference at %ld, %ld\n", filename, checks[k], i % raw->width, i / raw->width);
+                result = 1;
+            }
+        }
+        else {
+            float* planes = (float*) out;
+            for (long i = 0; i < pixels * 4 && !result; i++) {
+                int c = i / pixels;
+                if (fabs(planes[i] - convertedValue(layout, transfer, source[i % pixels], c)) < 1e-5) continue;
+                printf("MISMATCH %s, %s: first difference at %ld, %ld, channel %d\n", filename, checks[k],
+                    i % pixels % raw->width, i % pixels / raw->width, c);
+                result = 1;
+            }
+        }
+        free(out);
+        if (result) return result;
+    }
+    return 0;
+}
+
+// The container encode --progressive writes, put together in memory and fed to the
+// progressive decoder a piece at a time
+int checkProgressive(const char* filename, RawImage *raw) {
+    QoifImage passes[7];
+    long length = 14;
+    for (int p = 0; p < 7; p++) {
+        encodePass(*raw, p, &passes[p]);
+        if (err != NoError) {
+            for (int q = 0; q < p; q++) free(passes[q].data);
+            return checkFailed(filename, "progressive");
+        }
+        length += 4 + passes[p].bytesAdded;
+    }
+    unsigned char* data = malloc(length);
+    if (data) {
+        memcpy(data, "qprg", 4);
+        putBE32(data + 4, raw->width);
+        putBE32(data + 8, raw->height);
+        data[12] = raw->channels;
+        data[13] = raw->colorspace;
+        long pos = 14;
+        for (int p = 0; p < 7; p++) {
+            putBE32(data + pos, passes[p].bytesAdded);
+            memcpy(data + pos + 4, passes[p].data, passes[p].bytesAdded);
+            pos += 4 + passes[p].bytesAdded;
+        }
+    }
+    for (int p = 0; p < 7; p++) free(passes[p].data);
+    if (!data) {
+        err = MemAllocError;
+        return checkFailed(filename, "progressive");
+    }
+
+    ProgressiveDecoder dec = { .pass = -1 };
+    err = NoError;
+    for (long fed = 0; fed < length && dec.pass < 7 && err == NoError; fed += 4096) {
+        feedProgressive(&dec, data + fed, length - fed < 4096 ? length - fed : 4096);
+        while (err == NoError && advanceProgressive(&dec));
+    }
+    int result = 0;
+    if (err != NoError) {
+        result = checkFailed(filename, "progressive");
+    }
+    else if (dec.pass < 7) {
+        printf("MISMATCH %s, progressive: stopped in pass %d\n", filename, dec.pass);
+        result = 1;
+    }
+    else {
+        result = comparePixels(filename, "progressive", raw, dec.image, raw->totalLengthInPixels, 0);
+    }
+    free(data);
+    free(dec.data);
+    free(dec.image);
+    return result;
+}
+
+// encodeBatch and decodeBatch on VERIFY_BATCH prefixes of the image, from all rows down
+// to a few, so that the lanes start and finish at different times
+#define VERIFY_BATCH 6
+
+int checkBatch(const char* filename, QoifImage *qoif, RawImage *raw) {
+    RawImage images[VERIFY_BATCH];
+    QoifImage outputs[VERIFY_BATCH];
+    long offsets[VERIFY_BATCH + 1] = {0};
+    long pixels[VERIFY_BATCH];
+    unsigned char* inputs[VERIFY_BATCH];
+    PixelRGBA* decoded[VERIFY_BATCH];
+    for (int i = 0; i < VERIFY_BATCH; i++) {
+        images[i] = *raw;
+        images[i].height = raw->height - raw->height * i / VERIFY_BATCH;
+        images[i].totalLengthInPixels = (long) raw->width * images[i].height;
+        offsets[i+1] = offsets[i] + qoifBound(images[i]);
+    }
+    unsigned char* arena = malloc(offsets[VERIFY_BATCH]);
+    PixelRGBA* out = malloc(offsets[VERIFY_BATCH] / 5 * sizeof(PixelRGBA));
+    if (!arena || !out) {
+        free(arena);
+        free(out);
+        err = MemAllocError;
+        return checkFailed(filename, "batch");
+    }
+    encodeBatch(images, VERIFY_BATCH, arena, offsets, outputs);
+
+    int result = 0;
+    if (outputs[0].bytesAdded != qoif->bytesAdded || memcmp(outputs[0].data, qoif->data, qoif->bytesAdded) != 0) {
+        printf("MISMATCH %s, batch: stream differs from the serial one\n", filename);
+        result = 1;
+    }
+    long used = 0;
+    for (int i = 0; i < VERIFY_BATCH && !result; i++) {
+        long offset;
+        enum Error problem = validateQoif(outputs[i].data, outputs[i].bytesAdded, &offset, &pixels[i]);
+        if (problem != NoError || pixels[i] != images[i].totalLengthInPixels) {
+            printf("MISMATCH %s, batch: stream %d invalid at byte %ld: %s\n", filename, i, offset, errorMessages[problem]);
+            result = 1;
+        }
+        inputs[i] = outputs[i].data + 14;
+        decoded[i] = out + used;
+        used += pixels[i];
+    }
+    if (!result) decodeBatch(inputs, pixels, VERIFY_BATCH, decoded);
+    for (int i = 0; i < VERIFY_BATCH && !result; i++) {
+        result = comparePixels(filename, "batch", raw, decoded[i], pixels[i], 0);
+    }
+    free(arena);
+    free(out);
+    return result;
+}
+
+// 0 = identical, 1 = mismatch, 2 = could not be checked
+int verifyFile(const char* filename, VerifyJob *job) {
+    RawImage raw;
+    readPngFile(filename, &raw);
+    if (err != NoError) return checkFailed(filename, "PNG");
+
+    QoifImage qoif;
+    encodeImage(&raw, 0, &qoif);
+    if (err != NoError) {
+        free(raw.data);
+        return checkFailed(filename, "QOI");
+    }
+
+    int result = checkStream(filename, "QOI", &qoif, &raw, 0);
+    if (!result && job->all) {
+        long offset, covered;
+        enum Error problem = validateQoif(qoif.data, qoif.bytesAdded, &offset, &covered);
+        if (problem != NoError) {
+            printf("MISMATCH %s, validate: %s at byte %ld\n", filename, errorMessages[problem], offset);
+            result = 1;
+        }
+    }
+    if (!result && job->all) {
+        QoifImage striped;
+        encodeImage(&raw, 1, &striped);
+        if (err != NoError) result = checkFailed(filename, "parallel");
+        else if (striped.bytesAdded != qoif.bytesAdded || memcmp(striped.data, qoif.data, qoif.bytesAdded) != 0) {
+            printf("MISMATCH %s, parallel: stream differs from the serial one\n", filename);
+            result = 1;
+        }
+        if (err == NoError) free(striped.data);
+    }
+    if (!result && job->all) {
+        QoifImage near;
+        encodeImage(&raw, 2, &near);
+        if (err != NoError) result = checkFailed(filename, "near-lossless");
+        else {
+            result = checkStream(filename, "near-lossless", &near, &raw, VERIFY_NEAR);
+            free(near.data);
+        }
+    }
+    if (!result && job->all) {
+        QoifImage packed = { malloc(qoif.bytesAdded), qoif.bytesAdded };
+        err = packed.data ? NoError : MemAllocError;
+        if (packed.data) {
+            memcpy(packed.data, qoif.data, qoif.bytesAdded);
+            compressQoif(&packed);
+        }
+        if (err != NoError) result = checkFailed(filename, "qoiz");
+        else result = checkStream(filename, "qoiz", &packed, &raw, 0);
+        free(packed.data);
+    }
+    if (!result && job->all) result = checkLayouts(filename, &qoif, &raw);
+    if (!result && job->all) result = checkProgressive(filename, &raw);
+    if (!result && job->all) result = checkBatch(filename, &qoif, &raw);
+
+    pthread_mutex_lock(&job->lock);
+    job->pixels += raw.totalLengthInPixels;
+    job->qoifBytes += qoif.bytesAdded;
+    pthread_mutex_unlock(&job->lock);
+
+    free(raw.data);
+    free(qoif.data);
+    return result;
+}
+
+void* verifyWorker(void* arg) {
+    VerifyJob* job = arg;
+    while (1) {
+        long i = __atomic_fetch_add(&job->nextFile, 1, __ATOMIC_RELAXED);
+        if (i >= job->files->count) break;
+        int result = verifyFile(job->files->names[i], job);
+        if (result == 0) continue;
+        pthread_mutex_lock(&job->lock);
+        if (result == 1) job->mismatches++;
+        else job->failures++;
+        pthread_mutex_unlock(&job->lock);
+    }
+    return NULL;
+}
+
+
+// Hardware counters (verify --bench --perf) around the encode and decode cores. These are
+// writeBody and decodeBody from qoiEncoder.c and qoiDecoder.c, the very code encode and
+// decode link, so the counts hold for the shipped tools. Each counter is opened on its
+// own, so whatever the CPU or the VM doesn't offer is left out of the report instead of
+// failing the run.
+
+#define PERF_EVENTS 5
+
+typedef struct {
+    int fds[PERF_EVENTS];           // -1 where the counter isn't available
+    uint64_t start[PERF_EVENTS][3]; // value, time enabled, time running
+} PerfCounters;
+
+// Only set by --perf when at least one counter opened
+PerfCounters* perf = NULL;
+
+const char* perfEventNames[PERF_EVENTS] = { "cycles", "instr", "br-miss", "L1d-miss", "LLC-miss" };
+
+int openPerfCounters(PerfCounters *p) {
+    const uint64_t readMiss = (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+    const struct { uint32_t type; uint64_t config; } events[PERF_EVENTS] = {
+        { PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES },
+        { PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS },
+        { PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES },
+        { PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_L1D | readMiss },
+        { PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_LL | readMiss },
+    };
+    int opened = 0;
+    for (int i = 0; i < PERF_EVENTS; i++) {
+        struct perf_event_attr attr;
+        memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = events[i].type;
+        attr.config = events[i].config;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+        p->fds[i] = syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+        if (p->fds[i] >= 0) opened++;
+    }
+    return opened;
+}
+
+void readPerfCounter(int fd, uint64_t value[3]) {
+    if (read(fd, value, 3 * sizeof(uint64_t)) != 3 * sizeof(uint64_t)) value[0] = value[1] = value[2] = 0;
+}
+
+void startPerfCounters(PerfCounters *p) {
+    for (int i = 0; i < PERF_EVENTS; i++) {
+        if (p->fds[i] >= 0) readPerfCounter(p->fds[i], p->start[i]);
+    }
+}
+
+// Adds what was counted since startPerfCounters, scaled up if the kernel had to multiplex
+void stopPerfCounters(PerfCounters *p, double events[PERF_EVENTS]) {
+    for (int i = 0; i < PERF_EVENTS; i++) {
+        if (p->fds[i] < 0) continue;
+        uint64_t now[3];
+        readPerfCounter(p->fds[i], now);
+        double value = now[0] - p->start[i][0];
+        uint64_t enabled = now[1] - p->start[i][1];
+        uint64_t running = now[2] - p->start[i][2];
+        if (running > 0 && running < enabled) value *= (double) enabled / running;
+        events[i] += value;
+    }
+}
+
+// Benchmark (verify --bench): size and speed of QOI and qoiz against libpng, one image
+// at a time on a single thread. Every time is the best of benchRuns runs; --repeat
+// raises that, which turns a single image into a microbenchmark.
+
+int benchRuns = 5;
+
+typedef struct {
+    long pixels;
+    long pngBytes;
+    long qoifBytes;
+    long lzBytes;
+    double seconds[5]; // libpng decode, QOI encode, QOI decode, LZ pack, qoiz decode
+    double events[3][PERF_EVENTS]; // QOI encode, QOI decode, qoiz decode, summed over all runs
+} BenchResult;
+
+void keepFastest(double* best, struct timespec start) {
+    double seconds = secondsSince(start);
+    if (*best == 0 || seconds < *best) *best = seconds;
+}
+
+int benchFile(const char* filename, BenchResult *result) {
+    struct stat st;
+    if (stat(filename, &st) != 0) {
+        err = OpenFileError;
+        return 1;
+    }
+    *result = (BenchResult) { .pngBytes = st.st_size };
+    struct timespec start;
+
+    RawImage raw = {0};
+    for (int run = 0; run < benchRuns; run++) {
+        if (run > 0) free(raw.data);
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        readPngFile(filename, &raw);
+        if (err != NoError) return 1;
+        keepFastest(&result->seconds[0], start);
+    }
+    result->pixels = raw.totalLengthInPixels;
+
+    QoifImage qoif;
+    for (int run = 0; run < benchRuns; run++) {
+        if (run > 0) free(qoif.data);
+        if (perf) startPerfCounters(perf);
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        createQoifBuffer(raw, &qoif);
+        if (err != NoError) break;
+        writeHeader(&qoif, raw.width, raw.height, raw.channels==4, raw.colorspace);
+        writeBody(&qoif, raw);
+        writeFooter(&qoif);
+        keepFastest(&result->seconds[1], start);
+        if (perf) stopPerfCounters(perf, result->events[0]);
+    }
+    free(raw.data);
+    if (err != NoError) return 1;
+    result->qoifBytes = qoif.bytesAdded;
+
+    QoifImage packed = { NULL, 0 };
+    for (int run = 0; run < benchRuns && err == NoError; run++) {
+        free(packed.data);
+        packed.data = malloc(qoif.bytesAdded);
+        if (!packed.data) {
+            err = MemAllocError;
+            break;
+        }
+        memcpy(packed.data, qoif.data, qoif.bytesAdded);
+        packed.bytesAdded = qoif.bytesAdded;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        compressQoif(&packed);
+        keepFastest(&result->seconds[3], start);
+    }
+    result->lzBytes = packed.bytesAdded;
+
+    // both decodes go all the way to pixels, the qoiz one streams through the LZ window
+    QoifImage* inputs[2] = { &qoif, &packed };
+    for (int i = 0; i < 2 && err == NoError; i++) {
+        for (int run = 0; run < benchRuns; run++) {
+            QoifStream stream;
+            PixelBuffer decoded;
+            if (perf) startPerfCounters(perf);
+            clock_gettime(CLOCK_MONOTONIC, &start);
+            openQoifBuffer(inputs[i]->data, inputs[i]->bytesAdded, &stream, &decoded);
+            if (err != NoError) break;
+            decodeBody(&stream, &decoded);
+            keepFastest(&result->seconds[i == 0 ? 2 : 4], start);
+            if (perf) stopPerfCounters(perf, result->events[1 + i]);
+            free(decoded.data);
+            if (err != NoError) break;
+            if (decoded.pixelsAdded != result->pixels) {
+                err = LzError;
+                break;
+            }
+        }
+    }
+    free(qoif.data);
+    free(packed.data);
+    return err != NoError;
+}
+
+void printBenchLine(const char* name, BenchResult *r) {
+    printf("%-28.28s %9.1f %9.1f %9.1f %5.1f%% |", name,
+        r->pngBytes / 1e3, r->qoifBytes / 1e3, r->lzBytes / 1e3,
+        r->qoifBytes ? 100.0 * r->lzBytes / r->qoifBytes : 0);
+    for (int i = 0; i < 5; i++) printf(" %9.1f", r->seconds[i] ? r->pixels / 1e6 / r->seconds[i] : 0);
+    printf("\n");
+}
+
+void printPerfLines(BenchResult *r) {
+    const char* cores[3] = { "QOI enc", "QOI dec", "qoiz dec" };
+    double pixels = (double) r->pixels * benchRuns;
+    for (int c = 0; c < 3; c++) {
+        double* e = r->events[c];
+        printf("    %-9s", cores[c]);
+        for (int i = 0; i < PERF_EVENTS; i++) {
+            if (perf->fds[i] < 0) printf(" %s n/a", perfEventNames[i]);
+            else printf(" %.3f %s/px", pixels ? e[i] / pixels : 0, perfEventNames[i]);
+        }
+        if (perf->fds[0] >= 0 && perf->fds[1] >= 0 && e[0] > 0) printf(", IPC %.2f", e[1] / e[0]);
+        printf("\n");
+    }
+}
+
+// The batch lanes against the same images one at a time, BENCH_BATCH images per batch as
+// in encode --batch and decode --batch: encodeBatch against writeBody, decodeBatch
+// against decodeBody, each the best of benchRuns runs. Files that can't be read were
+// reported already and are left out.
+#define BENCH_BATCH 256
+
+typedef struct {
+    long images;
+    long pixels;
+    double seconds[4]; // encodeBatch, writeBody, decodeBatch, decodeBody
+} BatchBench;
+
+void benchBatch(FileList *files, long first, BatchBench *result) {
+    RawImage images[BENCH_BATCH];
+    QoifImage outputs[BENCH_BATCH];
+    long offsets[BENCH_BATCH + 1] = {0};
+    long pixels[BENCH_BATCH];
+    unsigned char* inputs[BENCH_BATCH];
+    PixelRGBA* decoded[BENCH_BATCH];
+    int count = 0;
+    for (long f = first; f < files->count && f < first + BENCH_BATCH; f++) {
+        readPngFile(files->names[f], &images[count]);
+        if (err != NoError) continue;
+        offsets[count+1] = offsets[count] + qoifBound(images[count]);
+        pixels[count] = images[count].totalLengthInPixels;
+        count++;
+    }
+    long total = offsets[count] / 5;
+    unsigned char* arena = malloc(offsets[count] + 1);
+    PixelRGBA* out = malloc((total + 62) * sizeof(PixelRGBA)); // decodeBody may overshoot by a RUN
+    err = arena && out ? NoError : MemAllocError;
+
+    double seconds[4] = {0};
+    struct timespec start;
+    for (int run = 0; run < benchRuns && err == NoError; run++) {
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        for (int i = 0; i < count; i++) {
+            QoifImage qoif = { arena + offsets[i], 0 };
+            writeHeader(&qoif, images[i].width, images[i].height, images[i].channels==4, images[i].colorspace);
+            writeBody(&qoif, images[i]);
+            writeFooter(&qoif);
+        }
+        keepFastest(&seconds[1], start);
+
+        // last, so that the streams decoded below are the batch encoder's
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        encodeBatch(images, count, arena, offsets, outputs);
+        keepFastest(&seconds[0], start);
+    }
+
+    long used = 0;
+    for (int i = 0; i < count; i++) {
+        inputs[i] = outputs[i].data + 14;
+        decoded[i] = out + used;
+        used += pixels[i];
+    }
+    for (int run = 0; run < benchRuns && err == NoError; run++) {
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        decodeBatch(inputs, pixels, count, decoded);
+        keepFastest(&seconds[2], start);
+
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        for (int i = 0; i < count && err == NoError; i++) {
+            QoifStream stream;
+            PixelBuffer raw = { decoded[i], 0 };
+            openQoifBuffer(outputs[i].data, outputs[i].bytesAdded, &stream, NULL);
+            if (err == NoError) decodeBody(&stream, &raw);
+        }
+        keepFastest(&seconds[3], start);
+    }
+
+    if (err == NoError) {
+        result->images += count;
+        result->pixels += used;
+        for (int k = 0; k < 4; k++) result->seconds[k] += seconds[k];
+    }
+    else printf("ERROR batch of %s: %s\n", files->names[first], errorMessages[err]);
+    for (int i = 0; i < count; i++) free(images[i].data);
+    free(arena);
+    free(out);
+}
+
+int runBench(FileList *files) {
+    BenchResult total = {0};
+    int failures = 0;
+
+    printf("%-28s %9s %9s %9s %6s | %9s %9s %9s %9s %9s\n", "file", "PNG kB", "QOI kB", "qoiz kB", "qoiz",
+        "libpng", "QOI enc", "QOI dec", "LZ pack", "qoiz dec");
+    printf("%-28s %36s | %49s\n", "", "", "MPixels/s");
+    for (long i = 0; i < files->count; i++) {
+        BenchResult r;
+        if (benchFile(files->names[i], &r)) {
+            printf("ERROR %s: %s\n", files->names[i], errorMessages[err]);
+            failures++;
+            continue;
+        }
+        const char* base = strrchr(files->names[i], '/');
+        printBenchLine(base ? base + 1 : files->names[i], &r);
+        if (perf) printPerfLines(&r);
+        total.pixels += r.pixels;
+        total.pngBytes += r.pngBytes;
+        total.qoifBytes += r.qoifBytes;
+        total.lzBytes += r.lzBytes;
+        for (int k = 0; k < 5; k++) total.seconds[k] += r.seconds[k];
+        for (int c = 0; c < 3; c++) {
+            for (int k = 0; k < PERF_EVENTS; k++) total.events[c][k] += r.events[c][k];
+        }
+    }
+    printBenchLine("total", &total);
+    if (perf) printPerfLines(&total);
+    if (total.seconds[4] > 0) {
+        printf("qoiz decodes %.1fx faster than libpng, QOI %.1fx\n",
+            total.seconds[0] / total.seconds[4], total.seconds[0] / total.seconds[2]);
+    }
+
+    BatchBench batch = {0};
+    for (long first = 0; first < files->count; first += BENCH_BATCH) benchBatch(files, first, &batch);
+    if (batch.images > 0 && batch.seconds[0] > 0 && batch.seconds[2] > 0) {
+        double mp = batch.pixels / 1e6;
+        printf("batch lanes, %ld images: encode %.1f MPixels/s, one at a time %.1f (%.2fx); "
+            "decode %.1f MPixels/s, one at a time %.1f (%.2fx)\n", batch.images,
+            mp / batch.seconds[0], mp / batch.seconds[1], batch.seconds[1] / batch.seconds[0],
+            mp / batch.seconds[2], mp / batch.seconds[3], batch.seconds[3] / batch.seconds[2]);
+    }
+    return failures ? 1 : 0;
+}
+
+
+int main(int argc, char** argv) {
+
+    int threads = sysconf(_SC_NPROCESSORS_ONLN);
+    FileList files = {0};
+    int bench = 0;
+    int all = 0;
+    int countEvents = 0;
+    int repeat = 0;
+    PerfCounters counters;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--bench") == 0) {
+            bench = 1;
+        }
+        else if (strcmp(argv[i], "--all") == 0) {
+            all = 1;
+        }
+        else if (strcmp(argv[i], "--perf") == 0) {
+            countEvents = 1;
+        }
+        else if (strcmp(argv[i], "--repeat") == 0 && i+1 < argc) {
+            benchRuns = atoi(argv[++i]);
+            if (benchRuns < 1) benchRuns = 1;
+            repeat = 1;
+        }
+        else if (strcmp(argv[i], "-j") == 0 && i+1 < argc) {
+            threads = atoi(argv[++i]);
+        }
+        else {
+            collectFiles(argv[i], ".png", &files);
+        }
+    }
+
+    if (files.count == 0 || ((countEvents || repeat) && !bench) || (all && bench)) {
+        puts("Usage: verify [-j threads] [--all] file.png|directory ...");
+        puts("       verify --bench [--perf] [--repeat runs] file.png|directory ...");
+        return 1;
+    }
+    if (err != NoError) {
+        printf("%s\n", errorMessages[err]);
+        return 1;
+    }
+    if (bench) {
+        if (countEvents && openPerfCounters(&counters) > 0) perf = &counters;
+        else if (countEvents) fprintf(stderr, "perf: no hardware counters available (perf_event_paranoid, container or VM), timing only\n");
+        return runBench(&files);
+    }
+    if (threads < 1) threads = 1;
+    if (threads > files.count) threads = files.count;
+
+    VerifyJob job = { .files = &files, .all = all };
+    pthread_mutex_init(&job.lock, NULL);
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    pthread_t workers[threads];
+    for (int i = 0; i < threads; i++) {
+        pthread_create(&workers[i], NULL, verifyWorker, &job);
+    }
+    for (int i = 0; i < threads; i++) {
+        pthread_join(workers[i], NULL);
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+
+    printf("%ld files, %ld mismatches, %ld errors\n", files.count, job.mismatches, job.failures);
+    printf("%.1f MPixels in %.3f s: %.1f MPixels/s, %.1f files/s, %.1f MB/s of QOI\n",
+        job.pixels / 1e6, seconds,
+        job.pixels / 1e6 / seconds,
+        files.count / seconds,
+        job.qoifBytes / 1e6 / seconds);
+
+    return job.mismatches || job.failures ? 1 : 0;
+}
@@ -0,0 +1,169 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#include "qoi.h"
+#include "watch.h"
+
+
+typedef struct WatchItem {
+    char* path;
+    struct timespec arrived;
+    struct WatchItem* next;
+} WatchItem;
+
+typedef struct {
+    WatchJob* job;
+    WatchItem* head;
+    WatchItem* tail;
+    pthread_mutex_t lock;
+    pthread_cond_t ready;
+    int nextWorker;
+} WatchQueue;
+
+int reserveWarm(unsigned char** buffer, long* capacity, long size) {
+    if (size <= *capacity) return 1;
+    free(*buffer);
+    *buffer = malloc(size);
+    *capacity = *buffer ? size : 0;
+    return *buffer != NULL;
+}
+
+void queueSpooledFile(WatchQueue *queue, const char* path) {
+    WatchItem* item = malloc(sizeof(WatchItem));
+    if (!item) return;
+    item->path = strdup(path);
+    item->next = NULL;
+    clock_gettime(CLOCK_MONOTONIC, &item->arrived);
+    pthread_mutex_lock(&queue->lock);
+    if (queue->tail) queue->tail->next = item;
+    else queue->head = item;
+    queue->tail = item;
+    pthread_cond_signal(&queue->ready);
+    pthread_mutex_unlock(&queue->lock);
+}
+
+void convertSpooledFile(WatchJob *job, const char* path, int worker, WarmBuffers *warm) {
+    int fd = open(path, O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0) {
+        if (fd >= 0) close(fd);
+        err = OpenFileError;
+        return;
+    }
+    if (!reserveWarm(&warm->in, &warm->inCapacity, st.st_size)) {
+        close(fd);
+        err = MemAllocError;
+        return;
+    }
+    long done = readWhole(fd, warm->in, st.st_size);
+    close(fd);
+    if (done < st.st_size) {
+        err = ReadFileError;
+        return;
+    }
+
+    err = NoError;
+    job->convert(warm, st.st_size);
+    if (err != NoError) return;
+
+    char name[4096], temp[8192], final[8192];
+    spriteName(path, name, sizeof(name));
+    snprintf(temp, sizeof(temp), "%s/.%s.%d.tmp", job->outdir, name, worker);
+    snprintf(final, sizeof(final), "%s/%s%s", job->outdir, name, job->outExtension);
+    fd = open(temp, O_WRONLY|O_CREAT|O_TRUNC, 0644);
+    if (fd < 0) {
+        err = OpenFileError;
+        return;
+    }
+    done = writeWhole(fd, warm->out, warm->outLength);
+    if (close(fd) != 0 || done < warm->outLength || rename(temp, final) != 0) {
+        unlink(temp);
+        err = WriteFileError;
+    }
+}
+
+void* watchWorker(void* arg) {
+    WatchQueue* queue = arg;
+    WarmBuffers warm = {0};
+    pthread_mutex_lock(&queue->lock);
+    int worker = queue->nextWorker++;
+    pthread_mutex_unlock(&queue->lock);
+
+    while (1) {
+        pthread_mutex_lock(&queue->lock);
+        while (!queue->head) pthread_cond_wait(&queue->ready, &queue->lock);
+        WatchItem* item = queue->head;
+        queue->head = item->next;
+        if (!queue->head) queue->tail = NULL;
+        pthread_mutex_unlock(&queue->lock);
+
+        convertSpooledFile(queue->job, item->path, worker, &warm);
+        if (err != NoError) printf("%s: %s\n", item->path, errorMessages[err]);
+        else printf("%s: converted in %.2f ms\n", item->path, secondsSince(item->arrived) * 1e3);
+        fflush(stdout);
+        free(item->path);
+        free(item);
+    }
+    return NULL;
+}
+
+// Hidden files are the temporaries of a writer, or our own
+int isSpooledFile(WatchJob *job, const char* name) {
+    return name[0] != '.' && hasExtension(name, job->inExtension);
+}
+
+int watchDirectory(WatchJob *job, int threads) {
+    int fd = inotify_init1(IN_CLOEXEC);
+    if (fd < 0 || inotify_add_watch(fd, job->spool, IN_CLOSE_WRITE | IN_MOVED_TO) < 0) {
+        printf("%s: %s\n", job->spool, strerror(errno));
+        return 1;
+    }
+
+    WatchQueue queue = { .job = job };
+    pthread_mutex_init(&queue.lock, NULL);
+    pthread_cond_init(&queue.ready, NULL);
+    if (threads < 1) threads = 1;
+    for (int i = 0; i < threads; i++) {
+        pthread_t worker;
+        pthread_create(&worker, NULL, watchWorker, &queue);
+        pthread_detach(worker);
+    }
+
+    // files that were already waiting before the watch started, in the spool directory
+    // itself: inotify doesn't see into its subdirectories either
+    char path[8192];
+    DIR* dir = opendir(job->spool);
+    struct dirent* entry;
+    while (dir && (entry = readdir(dir)) != NULL) {
+        struct stat st;
+        if (!isSpooledFile(job, entry->d_name)) continue;
+        snprintf(path, sizeof(path), "%s/%s", job->spool, entry->d_name);
+        if (stat(path, &st) == 0 && S_ISREG(st.st_mode)) queueSpooledFile(&queue, path);
+    }
+    if (dir) closedir(dir);
+
+    char events[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    while (1) {
+        ssize_t length = read(fd, events, sizeof(events));
+        if (length < 0) {
+            if (errno == EINTR) continue;
+            printf("%s: %s\n", job->spool, strerror(errno));
+            return 1;
+        }
+        for (char* p = events; p < events + length; ) {
+            struct inotify_event* event = (struct inotify_event*) p;
+            p += sizeof(struct inotify_event) + event->len;
+            if (event->len == 0 || !isSpooledFile(job, event->name)) continue;
+            snprintf(path, sizeof(path), "%s/%s", job->spool, event->name);
+            queueSpooledFile(&queue, path);
+        }
+    }
+}
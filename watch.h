@@ -0,0 +1,38 @@
+// Watch mode of encode --watch and decode --watch: converts files as soon as they are
+// completely written to, or moved into, the spool directory. Workers stay alive between
+// files and keep their buffers; output appears atomically through a rename.
+#ifndef WATCH_H
+#define WATCH_H
+
+#include "qoi.h"
+
+
+// Kept by every worker from one file to the next
+typedef struct {
+    unsigned char* in;     // file contents
+    long inCapacity;
+    unsigned char* pixels; // decoded image
+    long pixelCapacity;
+    unsigned char* out;    // converted file
+    long outLength;
+    long outCapacity;
+} WarmBuffers;
+
+// Grows one of the warm buffers to at least size bytes, its contents are lost. 0 if out of memory.
+int reserveWarm(unsigned char** buffer, long* capacity, long size);
+
+// What the tool does to every file: turns the length bytes in warm->in into warm->out, or sets err
+typedef void (*WatchConvert)(WarmBuffers *warm, long length);
+
+typedef struct {
+    const char* spool;
+    const char* outdir;
+    const char* inExtension;  // of the files picked up, with the dot
+    const char* outExtension; // of the outputs
+    WatchConvert convert;
+} WatchJob;
+
+// Runs until killed, returns 1 if the spool directory can't be watched
+int watchDirectory(WatchJob *job, int threads);
+
+#endif